@@ -0,0 +1,104 @@
+/* bench.c - Plays random games with the rules engine (no networking) and
+ * reports how fast it goes.
+ * Usage: 2310bench [games [players [seed]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "engine.h"
+#include "bot.h"
+
+#define DEFAULT_GAMES 1000000
+#define BENCH_DECKS 64
+
+/* Fill each deck with a random shuffle of the cards of a standard deck,
+ * followed by the end of deck marker
+ */
+void shuffle_decks(char decks[][DECK_SIZE + 1], unsigned int *seed) {
+    char cards[] = "1111122334455678", card;
+    int i, j, k;
+
+    for (i = 0; i < BENCH_DECKS; ++i) {
+        for (j = 0; j < DECK_SIZE; ++j) {
+            decks[i][j] = cards[j];
+        }
+        for (j = DECK_SIZE - 1; j > 0; --j) {
+            k = next_random(seed) % (j + 1);
+            card = decks[i][j];
+            decks[i][j] = decks[i][k];
+            decks[i][k] = card;
+        }
+        decks[i][DECK_SIZE] = 'E';
+    }
+}
+
+/* Plays one game to the end, each player picking a random valid move
+ * @return the number of moves played
+ */
+long play_random_game(struct Table *t, int players,
+        char decks[][DECK_SIZE + 1], unsigned int *seed) {
+    struct Move moves[MAX_MOVES];
+    struct Event e;
+    unsigned int winners;
+    long moveCount = 0;
+    int count;
+    char card;
+
+    engine_new_game(t, players);
+    while (!engine_game_won(t)) {
+        engine_deal(t, decks[next_random(seed) % BENCH_DECKS]);
+        while (!engine_start_turn(t, &card)) {
+            count = engine_valid_moves(t, moves);
+            if (count == 0) {
+                // Only a bad deck could leave no valid move
+                break;
+            }
+            engine_apply_move(t, &moves[next_random(seed) % count], &e);
+            moveCount++;
+        }
+        engine_end_round(t, &winners);
+    }
+    return moveCount;
+}
+
+int main(int argc, char *argv[]) {
+    char decks[BENCH_DECKS][DECK_SIZE + 1];
+    struct timespec start, end;
+    struct Table t;
+    long games = DEFAULT_GAMES, moves = 0, i;
+    int players = 4;
+    unsigned int seed = 2310;
+    double seconds;
+
+    if (argc > 1) {
+        games = atol(argv[1]);
+    }
+    if (argc > 2) {
+        players = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        seed = strtoul(argv[3], NULL, 10) | 1;
+    }
+    if (games < 1 || players < 2 || players > MAX_SEATS) {
+        fprintf(stderr, "Usage: 2310bench [games [players [seed]]]\n");
+        return 1;
+    }
+
+    shuffle_decks(decks, &seed);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < games; ++i) {
+        moves += play_random_game(&t, players, decks, &seed);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stdout, "games,%ld\nmoves,%ld\nseconds,%.3f\n", games, moves,
+            seconds);
+    fprintf(stdout, "games/sec,%.0f\nns/move,%.1f\n", games / seconds,
+            seconds * 1e9 / moves);
+    return 0;
+}
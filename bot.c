@@ -0,0 +1,72 @@
+/* bot.c - Strategies for playing games headless with the rules engine
+ */
+
+#include <stddef.h>
+
+#include "bot.h"
+
+/* A small fast random number generator (xorshift)
+ * @params state The state of the generator (must not be 0)
+ * @return the next random number
+ */
+unsigned int next_random(unsigned int *state) {
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Picks any of the valid moves at random
+ * @return the index of the chosen move
+ */
+int choose_random(struct Table *t, struct Move *moves, int count,
+        unsigned int *seed) {
+    return next_random(seed) % count;
+}
+
+/* Discards the lowest card held (so the highest is kept for the end of the
+ * round), with the target and guess picked at random
+ * @return the index of the chosen move
+ */
+int choose_low(struct Table *t, struct Move *moves, int count,
+        unsigned int *seed) {
+    char lowest = moves[0].discard;
+    int i, first = 0, matching = 0;
+
+    for (i = 0; i < count; ++i) {
+        if (moves[i].discard < lowest) {
+            lowest = moves[i].discard;
+        }
+    }
+    // Moves are listed grouped by the card discarded
+    for (i = 0; i < count; ++i) {
+        if (moves[i].discard == lowest) {
+            if (matching++ == 0) {
+                first = i;
+            }
+        }
+    }
+    return first + next_random(seed) % matching;
+}
+
+struct Bot bots[] = {
+    {'r', "random", choose_random},
+    {'l', "low", choose_low},
+};
+
+/* Finds a strategy by its letter
+ * @return the strategy or NULL if there is none with the letter
+ */
+struct Bot *find_bot(char letter) {
+    size_t i;
+
+    for (i = 0; i < sizeof(bots) / sizeof(bots[0]); ++i) {
+        if (bots[i].letter == letter) {
+            return &bots[i];
+        }
+    }
+    return NULL;
+}
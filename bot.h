@@ -0,0 +1,25 @@
+/* bot.h - Strategies for playing games headless with the rules engine
+ */
+
+#ifndef BOT_H_
+#define BOT_H_
+
+#include "engine.h"
+
+/* A strategy: picks one of the valid moves the player whose turn it is
+ * could make (as listed by engine_valid_moves, and only called when there 
+ * is at least one). Strategies are chosen by
+ * letter, so new ones only need adding to the bots table in bot.c.
+ */
+struct Bot {
+    char letter;
+    char *name;
+    int (*choose)(struct Table *t, struct Move *moves, int count,
+            unsigned int *seed);
+};
+
+// Function Prototypes
+unsigned int next_random(unsigned int *state);
+struct Bot *find_bot(char letter);
+
+#endif
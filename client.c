@@ -25,10 +25,15 @@
 #define PLAYER_LOSS 9
 //#define BAD_SYSTEM 20
 
+// Longest message the server sends during a game
+#define MESSAGE_LENGTH 22
+
 /* Player structure used to stored information about the client
- * including information received about other players.
+ * including information received about other players. binary is set if the
+ * binary protocol is used (see shared.h).
  */
 struct Player {
+    int binary;
     int players;
     char label;
     char *playerName;
@@ -37,7 +42,7 @@ struct Player {
     char *hostname;
     int serverComs;
     FILE *toServer;
-    FILE *fromServer;
+    struct LineReader fromServer;
 
     char firstCard;
     char secondCard;
@@ -77,7 +82,7 @@ void exit_player(struct Player *p, int status) {
         case NO_ERROR:
             exit(NO_ERROR);
         case BAD_ARG_NUMBER:
-            fprintf(stderr, "Usage: client name game_name port host\n");
+            fprintf(stderr, "Usage: client [-b] name game_name port host\n");
             exit(BAD_ARG_NUMBER);
         case BAD_PLAYER_NAME:
             fprintf(stderr, "Invalid player name\n");
@@ -257,44 +262,30 @@ void connect_to_server(struct Player *p) {
     
     p->serverComs = serverComs;
 
-    p->fromServer = fdopen(serverComs, "r");
+    init_line_reader(&p->fromServer, serverComs, LINE_BUFFER - 1);
     p->toServer = fdopen(serverComs, "w");
 
+    if (p->binary) {
+        fprintf(p->toServer, "%s\n", BINARY_HELLO);
+    }
     fprintf(p->toServer, "%s\n", p->playerName);
     fprintf(p->toServer, "%s\n", p->gameName);
     flush_streams(p);
 }
 
 /*
- * Get a message of any length from the player 
- * @return returns a char pointer to a heap allocated message of any length
+ * Get a line of game information (of any length up to LINE_BUFFER) from the
+ * server 
+ * @return returns a char pointer to a heap allocated copy of the line
  */
 char* get_message(struct Player *p) {
-    int i = 0;
-    char *buffer = calloc(2, sizeof(char));
-    char messagePart;
-
-    while(1) {
-        messagePart = fgetc(p->fromServer);
-
-        if (messagePart == EOF || messagePart == '\n') {
-            i++;
-            break;
-        }
+    char *line;
 
-        buffer[i] = messagePart;
-        i++;
-
-        buffer = realloc(buffer, ((sizeof(char) * 2) + i));
-    }
-
-    buffer[i] = 0;
-
-    if (strlen(buffer) == 0) {
+    if (read_line(&p->fromServer, &line) != LINE_READY || line[0] == 0) {
         exit_player(p, BAD_GAME_INFO);
     }
 
-    return buffer;
+    return strdup(line);
 }
 
 /*
@@ -339,10 +330,10 @@ void init_round(struct Player *p) {
     char blankCards[] = {'-', '-', '-', '-', '-', '-', '-', '-', '-'};
     char notPlayingCards[] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-    strncpy(p->cardsPlayedA, blankCards, 9);
-    strncpy(p->cardsPlayedB, blankCards, 9);
-    strncpy(p->cardsPlayedC, blankCards, 9);
-    strncpy(p->cardsPlayedD, blankCards, 9);
+    memcpy(p->cardsPlayedA, blankCards, 9);
+    memcpy(p->cardsPlayedB, blankCards, 9);
+    memcpy(p->cardsPlayedC, blankCards, 9);
+    memcpy(p->cardsPlayedD, blankCards, 9);
     p->statusA = ' ';
     p->statusB = ' ';
     p->statusC = ' ';
@@ -352,10 +343,10 @@ void init_round(struct Player *p) {
 
     switch (p->players) {
         case 2:
-            strncpy(p->cardsPlayedC, notPlayingCards, 9);
+            memcpy(p->cardsPlayedC, notPlayingCards, 9);
             p->statusC = 0;
         case 3:
-            strncpy(p->cardsPlayedD, notPlayingCards, 9);
+            memcpy(p->cardsPlayedD, notPlayingCards, 9);
             p->statusD = 0;
     }
 }
@@ -670,8 +661,8 @@ void get_move(struct Player *p) {
 
 
 /* Compares command given with valid commands available. If command is valid
- * returns a different code for each command. If command is not valid, exits
- * due to invalid message.
+ * returns a different code for each command (the command's binary protocol
+ * opcode). If command is not valid, exits due to invalid message.
  * @params p The player structure
  * @params command the command read from stdin
  * @return A command code. Each valid command has a unique code
@@ -682,28 +673,28 @@ int process_command(struct Player *p, char *command) {
             replace[] = "replace", scores[] = "scores", yes[] = "YES";
 
     if (!(strcmp(command, gameover))) {
-        return 1;
+        return OP_GAMEOVER;
     }
     if (!(strcmp(command, newround))) {
-        return 2;
+        return OP_NEWROUND;
     }
     if (!(strcmp(command, yourturn))) {
-        return 3;
+        return OP_YOURTURN;
     }
     if (!(strcmp(command, thishappened))) {
-        return 4;
+        return OP_HAPPENED;
     }
     if (!(strcmp(command, replace))) {
-        return 5;
+        return OP_REPLACE;
     }
     if (!(strcmp(command, scores))) {
-        return 6;
+        return OP_SCORES;
     }
     if (!(strcmp(command, yes))) {
-        return 7;
+        return OP_YES;
     }
     if (!(strcmp(command, no))) {
-        return 8;
+        return OP_NO;
     }
 
     exit_player(p, BAD_MESSAGE);
@@ -713,29 +704,92 @@ int process_command(struct Player *p, char *command) {
 
 /*
  * Gets a message from the server.
- * @return a poitner to the message
+ * @return a pointer to the message, which is only valid until the next 
+ * message is read
  */
 char* get_server_message(struct Player *p) {
-    char *messageIn, *input, c;
-    int length;
+    char *messageIn;
+
+    switch (read_line(&p->fromServer, &messageIn)) {
+        case LINE_READY:
+            if (strlen(messageIn) > MESSAGE_LENGTH) {
+                exit_player(p, BAD_MESSAGE);
+            }
+            return messageIn;
+        case LINE_TOO_LONG:
+            exit_player(p, BAD_MESSAGE);
+    }
+    exit_player(p, SERVER_LOSS);
 
-    messageIn = calloc(23, sizeof(char));
+    return NULL;
+}
 
-    input = fgets(messageIn, 23, p->fromServer);
-    //fprintf(stderr, "From Server: %s", messageIn);
+/* Gets a message from the server as a binary frame. Its fields are put in 
+ * param as the parameter of the text message would have them, so they are
+ * checked the same way.
+ * @params p The player structure
+ * @params param Set to the message's parameter ("" if it has none)
+ * @return the message's command code (its opcode)
+ */
+int get_server_frame(struct Player *p, char *param) {
+    char frame[FRAME_LENGTH], fields[2 * FRAME_LENGTH];
+    int opcode, length = 0, i;
 
-    if (input == NULL) {
+    if (read_frame(&p->fromServer, frame, FRAME_LENGTH) != LINE_READY) {
         exit_player(p, SERVER_LOSS);
     }
+    opcode = (unsigned char)frame[0];
+    if (opcode < OP_GAMEOVER || opcode > OP_NO) {
+        exit_player(p, BAD_MESSAGE);
+    }
+    unpack_fields(fields, frame + 1, FRAME_LENGTH - 1);
 
-    length = strlen(input);
-    if (input[length - 1] != '\n') {
-        while ((c = fgetc(p->fromServer)) != '\n' && c != EOF);
+    if (opcode == OP_HAPPENED && strlen(fields) == 7) {
+        sprintf(param, "%.4s/%s", fields, fields + 4);
+    } else if (opcode == OP_SCORES) {
+        for (i = 0; fields[i]; ++i) {
+            length += sprintf(param + length, i ? " %c" : "%c", fields[i]);
+        }
+        param[length] = 0;
+    } else {
+        strcpy(param, fields);
     }
+    return opcode;
+}
 
-    //fprintf(stderr, "From Server: %s\n", messageIn);
+/* Gets the next message from the server, in whichever protocol is used
+ * @params p The player structure
+ * @params param Set to the message's parameter, everything after the 
+ * command ("" if it has none)
+ * @return the message's command code
+ */
+int get_command(struct Player *p, char *param) {
+    char *messageIn, command[23];
+
+    if (p->binary) {
+        return get_server_frame(p, param);
+    }
+    messageIn = get_server_message(p);
+    command[0] = param[0] = 0;
+    sscanf(messageIn, "%s %[^\n]", command, param);
+    return process_command(p, command);
+}
+
+/* Sends the move in the player structure (played card, target player, 
+ * guessed card) to the server, as a line or a move frame
+ * @params p The player structure
+ */
+void send_move(struct Player *p) {
+    char move[] = {p->playCard, p->targetPlayer, p->guessedCard, 0};
+    char frame[MOVE_FRAME_LENGTH];
 
-    return messageIn;
+    if (p->binary) {
+        pack_fields(frame, MOVE_FRAME_LENGTH, move);
+        fwrite(frame, 1, MOVE_FRAME_LENGTH, p->toServer);
+    } else {
+        fprintf(p->toServer, "%s\n", move);
+    }
+    fflush(p->toServer);
 }
 
 /* Process yourturn message by performing turn start actions (remove
@@ -745,7 +799,7 @@ char* get_server_message(struct Player *p) {
  * @params param The param passed in from command- a card
  */
 void your_turn(struct Player *p, char *param) {
-    char card, label, *messageIn, command[23];
+    char card, label, reply[23];
 
     card = read_single_card(p, param);
     p->secondCard = card;
@@ -760,21 +814,11 @@ void your_turn(struct Player *p, char *param) {
     print_status(p);
 
     get_move(p);
+    send_move(p);
 
-    fprintf(p->toServer, "%c%c%c\n", p->playCard, p->targetPlayer,
-            p->guessedCard);
-    fflush(p->toServer);
-    
-    messageIn = get_server_message(p);
-    sscanf(messageIn, "%s", command);
-
-    while(process_command(p, command) != 7) {
+    while(get_command(p, reply) != OP_YES) {
         get_move(p);
-        fprintf(p->toServer, "%c%c%c\n", p->playCard, p->targetPlayer,
-                p->guessedCard);
-        fflush(p->toServer);
-        messageIn = get_server_message(p);
-        sscanf(messageIn, "%s", command);
+        send_move(p);
     }
 
     if (p->firstCard == p->playCard) {
@@ -951,18 +995,18 @@ void this_happened(struct Player *p, char *param) {
 /* Reads, validates and prints the scores messaged recieved from stdin
  * Exits if invalid message
  * @param p The player structure
- * @param messageIn A scores message
+ * @param param The scores, the parameter of a scores message
  */
-void scores(struct Player *p, char *messageIn) {
+void scores(struct Player *p, char *param) {
     int scoreA = 0, scoreB = 0, scoreC = 0, scoreD = 0, scoresCount = 0,
-            messageLength; 
+            paramLength; 
 
-    messageLength = strlen(messageIn);
-    if (messageLength != (11 + 2 * ((p->players) - 2))) {
+    paramLength = strlen(param);
+    if (paramLength != 2 * p->players - 1) {
         exit_player(p, BAD_MESSAGE);
     }
 
-    scoresCount = sscanf(messageIn, "%*s %d %d %d %d", &scoreA, &scoreB, 
+    scoresCount = sscanf(param, "%d %d %d %d", &scoreA, &scoreB, 
             &scoreC, &scoreD);    
     if (scoresCount != p->players) {
         exit_player(p, BAD_MESSAGE);
@@ -996,16 +1040,13 @@ void scores(struct Player *p, char *messageIn) {
  * @param p The player structure
  */
 void play_game(struct Player *p) {
-    char *messageIn, command[23], param[23];
-    int argCount, commandCode;
-
-    messageIn = get_server_message(p);
+    char param[23];
+    int commandCode;
 
-    argCount = sscanf(messageIn, "%s %[^\n]", command, param);
-    commandCode = process_command(p, command);
+    commandCode = get_command(p, param);
 
-    if (commandCode == 1) { 
-        if (argCount == 1) {
+    if (commandCode == OP_GAMEOVER) { 
+        if (param[0] == 0) {
             fprintf(stdout, "Game over\n");
             fflush(stdout);
             exit_player(p, NO_ERROR);
@@ -1013,25 +1054,25 @@ void play_game(struct Player *p) {
         exit_player(p, BAD_MESSAGE);
     }
 
-    if (argCount != 2) {
+    if (param[0] == 0) {
         exit_player(p, BAD_MESSAGE);
     }
 
     switch (commandCode) {
-        case 2:
+        case OP_NEWROUND:
             new_round(p, param);
             break;
-        case 3:
+        case OP_YOURTURN:
             your_turn(p, param);
             break;
-        case 4:
+        case OP_HAPPENED:
             this_happened(p, param);
             break;
-        case 5:
+        case OP_REPLACE:
             replace(p, param);
             break;
-        case 6:
-            scores(p, messageIn);
+        case OP_SCORES:
+            scores(p, param);
             break;
     }
 }
@@ -1041,6 +1082,14 @@ int main(int argc, char *argv[]) {
     struct Player *p = NULL;
 
     p = malloc(sizeof(*p));
+    p->binary = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-b")) {
+        // Use the binary protocol
+        p->binary = 1;
+        argc--;
+        argv++;
+    }
 
     if (argc != 5 && argc != 4) {
         exit_player(p, BAD_ARG_NUMBER);
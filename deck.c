@@ -0,0 +1,273 @@
+/* deck.c - Loading decks from deckfiles
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include "deck.h"
+
+/* Check that a deck (supplied as a string) is valid by checking the length
+ * then counting to make sure it contains exactly the right number and type
+ * of each card.
+ * @params deck A string containing the cards of a deck
+ * @return returns a 1 if invalid, 0 if valid
+ */
+int check_deck(char *deck) {
+    int i, ones = 0, twos = 0, threes = 0, fours = 0, fives = 0, sixes = 0,
+            sevens = 0, eights = 0;
+
+    if (deck[16] != '\n' || deck[17] != 0) {
+        return DECK_FAIL;
+    }
+
+    for (i = 0; i < 16; ++i) {
+        if (deck[i] < '1' || deck[i] > '8') {
+            return 1;
+        }
+        switch (deck[i]) {
+            case '1':
+                ones++;
+                break;
+            case '2':
+                twos++;
+                break;
+            case '3':
+                threes++;
+                break;
+            case '4':
+                fours++;
+                break;
+            case '5':
+                fives++;
+                break;
+            case '6':
+                sixes++;
+                break;
+            case '7':
+                sevens++;
+                break;
+            case '8':
+                eights++;
+        }
+    }
+    if (ones != 5 || twos != 2 || threes != 2 || fours != 2 || fives != 2 ||
+            sixes != 1 || sevens != 1 || eights != 1) {
+        return DECK_FAIL;
+    }
+    return 0;
+}
+
+/* Packs the cards of a deck (as characters) two to a byte
+ * @params cards The DECK_CARDS cards of the deck
+ * @params packed Where to put the DECK_BYTES packed bytes
+ */
+void pack_deck(char *cards, unsigned char *packed) {
+    int i;
+
+    for (i = 0; i < DECK_BYTES; ++i) {
+        packed[i] = (cards[2 * i] - '0') | (cards[2 * i + 1] - '0') << 4;
+    }
+}
+
+/* Checks that a packed deck is valid: every card is 1 to 8, and there is 
+ * exactly the right number of each card (as for check_deck)
+ * @params packed The DECK_BYTES packed bytes of the deck
+ * @return returns DECK_FAIL if invalid, 0 if valid
+ */
+int check_packed_deck(const unsigned char *packed) {
+    static const int wanted[16] = {0, 5, 2, 2, 2, 2, 1, 1, 1};
+    int counts[16] = {0}, i;
+
+    for (i = 0; i < DECK_BYTES; ++i) {
+        counts[packed[i] & 0xF]++;
+        counts[packed[i] >> 4]++;
+    }
+    for (i = 0; i < 16; ++i) {
+        if (counts[i] != wanted[i]) {
+            return DECK_FAIL;
+        }
+    }
+    return 0;
+}
+
+/* Unpacks a deck into the cards (as characters) used by the rules engine,
+ * followed by the 'E' marking the end of the deck
+ * @params store The decks
+ * @params index Which deck to unpack (less than the number of decks)
+ * @params cards Where to put the DECK_CARDS + 1 cards
+ */
+void unpack_deck(struct DeckStore *store, uint64_t index, char *cards) {
+    const unsigned char *packed = store->packed + index * DECK_BYTES;
+    int i;
+
+    for (i = 0; i < DECK_BYTES; ++i) {
+        cards[2 * i] = '0' + (packed[i] & 0xF);
+        cards[2 * i + 1] = '0' + (packed[i] >> 4);
+    }
+    cards[DECK_CARDS] = 'E';
+}
+
+/* Reads length bytes of a file, starting offset bytes in
+ * @params fd The open file
+ * @params buffer Where to put the bytes
+ * @params length How many bytes to read
+ * @params offset Where in the file to start
+ * @return 0 if they were all read, or 1 if the file ended first or could 
+ *      not be read
+ */
+int read_fully(int fd, void *buffer, size_t length, off_t offset) {
+    ssize_t bytes;
+    size_t got = 0;
+
+    while (got < length) {
+        bytes = pread(fd, (char *)buffer + got, length - got, offset + got);
+        if (bytes <= 0) {
+            return 1;
+        }
+        got += bytes;
+    }
+    return 0;
+}
+
+/* Checks every deck of a text deckfile, then packs them into memory. The
+ * file is read whole so the decks can be checked in bulk with check_decks: as
+ * each deck must be a line of exactly 16 cards, the file must be made up of
+ * whole DECK_LINE byte decks.
+ * @params fd The open deckfile
+ * @params store The store to load the decks into
+ * @return returns 0 if successful or the appropriate error code if not
+ */
+int read_text_deckfile(int fd, struct DeckStore *store) {
+    struct stat info;
+    unsigned char *packed;
+    char *text;
+    uint64_t count, i;
+
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return DECKFILE_FAIL;
+    }
+    if (info.st_size % DECK_LINE) {
+        close(fd);
+        return DECK_FAIL;
+    }
+    count = info.st_size / DECK_LINE;
+    if (count == 0) {
+        close(fd);
+        return 0;
+    }
+
+    // Read rather than mapped, as a mapped file cut short while it is 
+    // being checked would kill the server with SIGBUS
+    text = malloc(info.st_size);
+    if (text == NULL || read_fully(fd, text, info.st_size, 0)) {
+        close(fd);
+        free(text);
+        return DECKFILE_FAIL;
+    }
+    close(fd);
+    if (check_decks(text, count) != count) {
+        free(text);
+        return DECK_FAIL;
+    }
+
+    packed = malloc(count * DECK_BYTES);
+    if (packed == NULL) {
+        free(text);
+        return DECKFILE_FAIL;
+    }
+    for (i = 0; i < count; ++i) {
+        pack_deck(text + i * DECK_LINE, packed + i * DECK_BYTES);
+    }
+    free(text);
+    store->packed = packed;
+    store->count = count;
+    return 0;
+}
+
+/* Reads the decks of a binary deckfile into memory and checks every one, 
+ * as anything could have written the file. The decks are copied rather 
+ * than mapped so that the file being cut short or rewritten while it is in
+ * use cannot affect (or kill) the server. Loading takes time in proportion
+ * to the number of decks (see deck.h).
+ * @params fd The open deckfile
+ * @params header The header read from the start of the file
+ * @params store The store to load the decks into
+ * @return returns 0 if successful or the appropriate error code if not
+ */
+int read_binary_deckfile(int fd, char *header, struct DeckStore *store) {
+    struct stat info;
+    unsigned char *packed;
+    uint64_t count, i;
+
+    memcpy(&count, header + sizeof(DECK_MAGIC) - 1, sizeof(count));
+    count = le64toh(count);
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return DECKFILE_FAIL;
+    }
+    if (count > (uint64_t)info.st_size / DECK_BYTES ||
+            (uint64_t)info.st_size != DECK_HEADER + count * DECK_BYTES) {
+        close(fd);
+        return DECK_FAIL;
+    }
+
+    packed = malloc(count * DECK_BYTES);
+    if (packed == NULL || 
+            read_fully(fd, packed, count * DECK_BYTES, DECK_HEADER)) {
+        close(fd);
+        free(packed);
+        return DECKFILE_FAIL;
+    }
+    close(fd);
+    for (i = 0; i < count; ++i) {
+        if (check_packed_deck(packed + i * DECK_BYTES)) {
+            free(packed);
+            return DECK_FAIL;
+        }
+    }
+    store->packed = packed;
+    store->count = count;
+    return 0;
+}
+
+/* Load every deck in a deckfile, either binary or text. A deckfile with no
+ * decks is treated as an invalid deck.
+ * @params filename The name of the deckfile
+ * @params store The store to load the decks into
+ * @return returns 0 if successful or the appropriate error code if not
+ */
+int load_deckfile(char *filename, struct DeckStore *store) {
+    char header[DECK_HEADER];
+    int fd, error;
+
+    memset(store, 0, sizeof(*store));
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return DECKFILE_FAIL;
+    }
+
+    if (read(fd, header, DECK_HEADER) == DECK_HEADER &&
+            memcmp(header, DECK_MAGIC, sizeof(DECK_MAGIC) - 1) == 0) {
+        error = read_binary_deckfile(fd, header, store);
+    } else {
+        error = read_text_deckfile(fd, store);
+    }
+    if (!error && store->count == 0) {
+        free_decks(store);
+        error = DECK_FAIL;
+    }
+    return error;
+}
+
+/* Frees the decks of a store
+ */
+void free_decks(struct DeckStore *store) {
+    free((void *)store->packed);
+    memset(store, 0, sizeof(*store));
+}
@@ -0,0 +1,50 @@
+/* deck.h - Loading decks from deckfiles
+ * Deckfiles are either text (a line of 16 cards per deck) or binary, as made
+ * from a text deckfile by 2310deckpack: DECK_MAGIC, the number of decks as
+ * a little endian 64 bit integer, then DECK_BYTES per deck with two cards 
+ * to a byte (the first card of each pair in the low 4 bits). The decks of
+ * both kinds are checked once, as they are loaded, so a store only ever 
+ * holds valid decks.
+ * Binary deckfiles are not loaded in constant time by mapping them: the
+ * check reads every deck anyway, and a mapping would let the file being 
+ * cut short kill the server with SIGBUS. They are read into memory in one
+ * pass, under half the bytes of the same decks as text, and need no 
+ * packing.
+ */
+
+#ifndef DECK_H_
+#define DECK_H_
+
+#include <stdint.h>
+
+// Errors loading a deckfile (also the server's exit statuses for them)
+#define DECKFILE_FAIL 2
+#define DECK_FAIL 3
+
+#define DECK_CARDS 16
+#define DECK_BYTES (DECK_CARDS / 2)
+#define DECK_LINE (DECK_CARDS + 1)
+#define DECK_MAGIC "2310DECK"
+#define DECK_HEADER 16
+
+/* The decks of a deckfile, packed DECK_BYTES to a deck (in memory from 
+ * malloc) and looked up by index
+ */
+struct DeckStore {
+    uint64_t count;
+    const unsigned char *packed;
+};
+
+// Function Prototypes
+int check_deck(char *deck);
+int check_packed_deck(const unsigned char *packed);
+uint64_t check_decks_scalar(const char *text, uint64_t count);
+uint64_t check_decks_sse2(const char *text, uint64_t count);
+uint64_t check_decks_avx2(const char *text, uint64_t count);
+uint64_t check_decks(const char *text, uint64_t count);
+void pack_deck(char *cards, unsigned char *packed);
+void unpack_deck(struct DeckStore *store, uint64_t index, char *cards);
+int load_deckfile(char *filename, struct DeckStore *store);
+void free_decks(struct DeckStore *store);
+
+#endif
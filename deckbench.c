@@ -0,0 +1,140 @@
+/* deckbench.c - Compares the ways of checking text decks: check_deck one
+ * deck at a time, and the bulk check_decks versions (scalar, SSE2, AVX2).
+ * Every version is first checked to agree with check_deck on broken decks.
+ * Usage: 2310deckbench [decks [seed]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "deck.h"
+#include "bot.h"
+
+#define DEFAULT_DECKS 1000000
+#define BROKEN_DECKS 100000
+
+/* A bulk deck checker being compared
+ */
+struct Checker {
+    char *name;
+    uint64_t (*check)(const char *, uint64_t);
+};
+
+/* Checks decks one at a time with check_deck, as load_deckfile used to
+ * (copying each line into a buffer as fgets did)
+ * @return the index of the first invalid deck, or count if all are valid
+ */
+uint64_t check_decks_single(const char *text, uint64_t count) {
+    char line[DECK_LINE + 1];
+    uint64_t i;
+
+    for (i = 0; i < count; ++i) {
+        memcpy(line, text + i * DECK_LINE, DECK_LINE);
+        line[DECK_LINE] = '\0';
+        if (check_deck(line)) {
+            return i;
+        }
+    }
+    return i;
+}
+
+/* Fills text with random valid decks
+ */
+void make_decks(char *text, uint64_t count, unsigned int *seed) {
+    char cards[] = "1111122334455678", card;
+    uint64_t i;
+    int j, k;
+
+    for (i = 0; i < count; ++i) {
+        for (j = DECK_CARDS - 1; j > 0; --j) {
+            k = next_random(seed) % (j + 1);
+            card = cards[j];
+            cards[j] = cards[k];
+            cards[k] = card;
+        }
+        memcpy(text + i * DECK_LINE, cards, DECK_CARDS);
+        text[i * DECK_LINE + DECK_CARDS] = '\n';
+    }
+}
+
+/* Breaks a valid deck by changing one byte (which may leave it valid if
+ * the byte is changed to the card it already was)
+ */
+void break_deck(char *deck, unsigned int *seed) {
+    static const char bytes[] = "012345678\n\xff";
+
+    deck[next_random(seed) % DECK_LINE] =
+            bytes[next_random(seed) % (sizeof(bytes) - 1)];
+}
+
+/* Checks a version agrees with check_deck on which deck is the first
+ * invalid one, over sets of three decks with one broken
+ * @return 1 if they agree, 0 if not
+ */
+int agrees(struct Checker *c, unsigned int *seed) {
+    char decks[DECK_LINE * 3];
+    int i;
+
+    for (i = 0; i < BROKEN_DECKS; ++i) {
+        make_decks(decks, 3, seed);
+        break_deck(decks + DECK_LINE * (i % 3), seed);
+        if (c->check(decks, 3) != check_decks_single(decks, 3)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    struct Checker checkers[] = {
+        {"check_deck", check_decks_single},
+        {"scalar", check_decks_scalar},
+#if defined(__x86_64__) || defined(__i386__)
+        {"sse2", check_decks_sse2},
+        {"avx2", check_decks_avx2},
+#endif
+        {"check_decks", check_decks},
+    };
+    struct timespec start, end;
+    uint64_t count = DEFAULT_DECKS, checked;
+    unsigned int seed = 2310;
+    double seconds;
+    char *text;
+    size_t i;
+
+    if (argc > 1) {
+        count = strtoull(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        seed = strtoul(argv[2], NULL, 10) | 1;
+    }
+    if (count < 1) {
+        fprintf(stderr, "Usage: 2310deckbench [decks [seed]]\n");
+        return 1;
+    }
+
+    text = malloc(count * DECK_LINE);
+    make_decks(text, count, &seed);
+
+    fprintf(stdout, "checker,agrees,decks/sec,ns/deck\n");
+    for (i = 0; i < sizeof(checkers) / sizeof(checkers[0]); ++i) {
+#if defined(__x86_64__) || defined(__i386__)
+        if (checkers[i].check == check_decks_avx2 &&
+                !__builtin_cpu_supports("avx2")) {
+            continue;
+        }
+#endif
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        checked = checkers[i].check(text, count);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        seconds = (end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stdout, "%s,%s,%.0f,%.2f\n", checkers[i].name,
+                (checked == count && agrees(&checkers[i], &seed)) ?
+                "yes" : "no", count / seconds, seconds * 1e9 / count);
+    }
+    free(text);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/* deckcheck.c - Checking many text decks at once
+ * Each deck is DECK_LINE bytes: 16 cards then a newline. A deck is valid
+ * when every card is between '1' and '8' and there are exactly 5 ones, 2
+ * each of twos to fives and 1 each of sixes to eights. The SSE2 and AVX2
+ * versions count each card with a compare and the number of bits set in
+ * the compare's mask. Once the cards are known to be in range only the
+ * twos to eights need counting, as the rest of the 16 cards must be ones.
+ * check_decks uses the best version the CPU supports.
+ */
+
+#include <stddef.h>
+
+#include "deck.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DECK_SIMD
+#include <immintrin.h>
+#endif
+
+// The card counts of a valid deck, 4 bits per card starting with the ones
+#define DECK_HISTOGRAM 0x11122225u
+
+/* Checks decks one card at a time. The count of each card is kept in 4 bits
+ * of a sum: as there are only 16 cards, the sum can only match the counts
+ * of a valid deck if every count matches.
+ * @params text The decks
+ * @params count The number of decks
+ * @return the index of the first invalid deck, or count if all are valid
+ */
+uint64_t check_decks_scalar(const char *text, uint64_t count) {
+    const unsigned char *deck;
+    unsigned int sum, card;
+    uint64_t i;
+    int j;
+
+    for (i = 0; i < count; ++i) {
+        deck = (const unsigned char *)text + i * DECK_LINE;
+        sum = 0;
+        for (j = 0; j < DECK_CARDS; ++j) {
+            card = deck[j] - '1';
+            if (card > 7) {
+                return i;
+            }
+            sum += 1u << (card * 4);
+        }
+        if (sum != DECK_HISTOGRAM || deck[DECK_CARDS] != '\n') {
+            return i;
+        }
+    }
+    return i;
+}
+
+#ifdef DECK_SIMD
+
+/* Checks a mask has exactly the number of bits set (without needing the
+ * popcnt instruction, which not every SSE2 CPU has)
+ * @return 1 if it does, 0 if not
+ */
+static inline int has_bits(unsigned int mask, int bits) {
+    for (; bits > 1; --bits) {
+        mask &= mask - 1;
+    }
+    return mask != 0 && (mask & (mask - 1)) == 0;
+}
+
+/* Checks decks 16 cards (a whole deck) at a time with SSE2
+ * @params text The decks
+ * @params count The number of decks
+ * @return the index of the first invalid deck, or count if all are valid
+ */
+__attribute__((target("sse2")))
+uint64_t check_decks_sse2(const char *text, uint64_t count) {
+    static const int expected[8] = {5, 2, 2, 2, 2, 1, 1, 1};
+    const __m128i one = _mm_set1_epi8('1'), eight = _mm_set1_epi8('8');
+    __m128i cards, bad;
+    uint64_t i;
+    int card;
+
+    for (i = 0; i < count; ++i) {
+        cards = _mm_loadu_si128((const __m128i *)(text + i * DECK_LINE));
+        bad = _mm_or_si128(_mm_cmplt_epi8(cards, one),
+                _mm_cmpgt_epi8(cards, eight));
+        if (_mm_movemask_epi8(bad) || text[i * DECK_LINE + DECK_CARDS] !=
+                '\n') {
+            return i;
+        }
+        for (card = 1; card < 8; ++card) {
+            if (!has_bits(_mm_movemask_epi8(_mm_cmpeq_epi8(cards,
+                    _mm_set1_epi8('1' + card))), expected[card])) {
+                return i;
+            }
+        }
+    }
+    return i;
+}
+
+/* Checks decks two at a time with AVX2, one deck in each 128 bit lane.
+ * Any odd deck left at the end is checked with SSE2.
+ * @params text The decks
+ * @params count The number of decks
+ * @return the index of the first invalid deck, or count if all are valid
+ */
+__attribute__((target("avx2,popcnt")))
+uint64_t check_decks_avx2(const char *text, uint64_t count) {
+    static const int expected[8] = {5, 2, 2, 2, 2, 1, 1, 1};
+    const __m256i one = _mm256_set1_epi8('1'), eight = _mm256_set1_epi8('8');
+    __m256i cards, bad;
+    unsigned int mask;
+    const char *pair;
+    uint64_t i;
+    int card;
+
+    for (i = 0; i + 1 < count; i += 2) {
+        pair = text + i * DECK_LINE;
+        cards = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)pair)),
+                _mm_loadu_si128((const __m128i *)(pair + DECK_LINE)), 1);
+        bad = _mm256_or_si256(_mm256_cmpgt_epi8(one, cards),
+                _mm256_cmpgt_epi8(cards, eight));
+        if (_mm256_movemask_epi8(bad) || pair[DECK_CARDS] != '\n' ||
+                pair[DECK_LINE + DECK_CARDS] != '\n') {
+            break;
+        }
+        for (card = 1; card < 8; ++card) {
+            mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(cards,
+                    _mm256_set1_epi8('1' + card)));
+            if (__builtin_popcount(mask & 0xFFFF) != expected[card] ||
+                    __builtin_popcount(mask >> 16) != expected[card]) {
+                break;
+            }
+        }
+        if (card < 8) {
+            break;
+        }
+    }
+    // The pair with an invalid deck (or the last deck) is checked alone
+    return i + check_decks_sse2(text + i * DECK_LINE, count - i);
+}
+
+#endif
+
+/* Checks many text decks at once, using the fastest version the CPU
+ * supports (chosen on the first call).
+ * @params text The decks
+ * @params count The number of decks
+ * @return the index of the first invalid deck, or count if all are valid
+ */
+uint64_t check_decks(const char *text, uint64_t count) {
+    static uint64_t (*best)(const char *, uint64_t) = NULL;
+    uint64_t (*check)(const char *, uint64_t);
+
+    check = __atomic_load_n(&best, __ATOMIC_RELAXED);
+    if (check == NULL) {
+#ifdef DECK_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            check = check_decks_avx2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            check = check_decks_sse2;
+        } else {
+            check = check_decks_scalar;
+        }
+#else
+        check = check_decks_scalar;
+#endif
+        __atomic_store_n(&best, check, __ATOMIC_RELAXED);
+    }
+    return check(text, count);
+}
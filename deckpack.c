@@ -0,0 +1,45 @@
+/* deckpack.c - Converts a text deckfile into a binary deckfile (see deck.h)
+ * which the server and 2310selfplay can load without checking each deck.
+ * Usage: 2310deckpack textdeckfile binarydeckfile
+ */
+
+#include <stdio.h>
+#include <endian.h>
+
+#include "deck.h"
+
+#define WRITE_FAIL 4
+
+int main(int argc, char *argv[]) {
+    struct DeckStore store;
+    FILE *out;
+    uint64_t count;
+    int error;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: 2310deckpack textdeckfile binarydeckfile\n");
+        return 1;
+    }
+
+    // Every deck is checked as the deckfile is loaded
+    if ((error = load_deckfile(argv[1], &store))) {
+        fprintf(stderr, (error == DECKFILE_FAIL) ?
+                "Unable to access deckfile\n" : "Error reading deck\n");
+        return error;
+    }
+
+    // The count is written little endian whatever the machine
+    count = htole64(store.count);
+    out = fopen(argv[2], "w");
+    if (out == NULL ||
+            fwrite(DECK_MAGIC, sizeof(DECK_MAGIC) - 1, 1, out) != 1 ||
+            fwrite(&count, sizeof(count), 1, out) != 1 ||
+            fwrite(store.packed, DECK_BYTES, store.count, out) !=
+            store.count || fclose(out) != 0) {
+        fprintf(stderr, "Unable to write deckfile\n");
+        return WRITE_FAIL;
+    }
+    fprintf(stdout, "%llu decks\n", (unsigned long long)store.count);
+    free_decks(&store);
+    return 0;
+}
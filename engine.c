@@ -0,0 +1,296 @@
+/* engine.c - Love Letter rules engine
+ */
+
+#include <string.h>
+
+#include "shared.h"
+#include "engine.h"
+
+/* Gets a new card from the deck. If the card is 'E', which is a dummy
+ * card signalling the end of the deck, the deck is set as empty.
+ * @params t The table
+ * @return the new card drawn from the deck
+ */
+char draw_card(struct Table *t) {
+    char card = t->deck[t->nextCard++];
+
+    if (card == 'E') {
+        t->emptyDeck = 1;
+    }
+    return card;
+}
+
+/* Gets the seat of a player from their label
+ */
+int seat_of(char player) {
+    return player - 'A';
+}
+
+/* Marks a player as out by clearing their cards and taking them out of the
+ * alive (and protected) players.
+ * @params t The table
+ * @params out The player to mark as out ('-' for none)
+ */
+void set_out(struct Table *t, char out) {
+    int seat = seat_of(out);
+
+    if (out == '-') {
+        return;
+    }
+    t->seats[seat].hand[0] = '-';
+    t->seats[seat].hand[1] = '-';
+    t->alive &= ~(1u << seat);
+    t->protected &= ~(1u << seat);
+}
+
+/* Checks to see if a player can't be targeted, because they are not playing
+ * or are out (players can always target themselves). Protection by a 4 is
+ * tracked but, as the server has always done, not enforced.
+ * @params t The table
+ * @params target The player targeted ('-' for none)
+ * @params source The player whose turn it is
+ * @return 1 if the target can't be targeted, a 0 if they can
+ */
+int target_unavailable(struct Table *t, char target, char source) {
+    unsigned int bit;
+
+    if (target == '-' || target == source) {
+        return 0;
+    }
+    if (target < 'A' || target >= 'A' + t->players) {
+        return 1;
+    }
+    bit = 1u << seat_of(target);
+    return !(t->alive & bit);
+}
+
+/* Set up the table for a new game with no points
+ * @params t The table
+ * @params players The number of players (at most MAX_SEATS)
+ */
+void engine_new_game(struct Table *t, int players) {
+    memset(t, 0, sizeof(*t));
+    t->players = players;
+}
+
+/* Start a new round with the supplied deck: set aside the first card, give
+ * each player a card and set all of the players alive (and not protected).
+ * Player A has the first turn.
+ * @params t The table
+ * @params deck The cards of the deck (DECK_SIZE cards then 'E')
+ */
+void engine_deal(struct Table *t, char *deck) {
+    int seat;
+
+    t->deck = deck;
+    t->nextCard = 0;
+    t->emptyDeck = 0;
+    t->turn = 0;
+    t->alive = (1u << t->players) - 1;
+    t->protected = 0;
+    t->burntCard = draw_card(t);
+
+    for (seat = 0; seat < t->players; ++seat) {
+        t->seats[seat].hand[0] = draw_card(t);
+        t->seats[seat].hand[1] = '-';
+    }
+}
+
+/* Starts the turn of the next alive player by giving them a new card. If
+ * there is only one alive player left or the deck has run out of cards the
+ * round is over instead.
+ * @params t The table
+ * @params card Set to the card drawn by the player whose turn it is (turn)
+ * @return 1 if the round is over, otherwise 0
+ */
+int engine_start_turn(struct Table *t, char *card) {
+    if (__builtin_popcount(t->alive) < 2 || t->emptyDeck) {
+        return 1;
+    }
+    while (!((t->alive >> t->turn) & 1)) {
+        t->turn = (t->turn + 1) % t->players;
+    }
+    // Protection from a 4 lasts until the player's next turn
+    t->protected &= ~(1u << t->turn);
+
+    *card = draw_card(t);
+    if (*card == 'E') {
+        return 1;
+    }
+    t->seats[t->turn].hand[1] = *card;
+    return 0;
+}
+
+/* Checks to see if a move by the player whose turn it is would be valid:
+ * they must hold the card, the move must be allowed by the rules and the
+ * target must be able to be targeted.
+ * @params t The table
+ * @params m The move
+ * @return 1 if the move is invalid, 0 if it is valid
+ */
+int engine_check_move(struct Table *t, struct Move *m) {
+    char *hand = t->seats[t->turn].hand, source = 'A' + t->turn;
+
+    if ((m->discard != hand[0] && m->discard != hand[1]) ||
+            check_valid_move(source, m->discard, m->target, m->guess,
+            t->players) || target_unavailable(t, m->target, source)) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Plays a move for the player whose turn it is, if it is valid, and moves
+ * the turn on to the next player.
+ * @params t The table
+ * @params m The move
+ * @params e Set to what happened as a result of the move
+ * @return 1 if the move was invalid (and nothing happened), otherwise 0
+ */
+int engine_apply_move(struct Table *t, struct Move *m, struct Event *e) {
+    char *hand = t->seats[t->turn].hand, source = 'A' + t->turn, card;
+    char targetHand;
+    int target = seat_of(m->target);
+
+    if (engine_check_move(t, m)) {
+        return 1;
+    }
+
+    e->source = source;
+    e->discard = m->discard;
+    e->target = m->target;
+    e->guess = m->guess;
+    e->dropper = '-';
+    e->dropped = '-';
+    e->out = '-';
+    memset(e->replaced, 0, sizeof(e->replaced));
+
+    if (m->discard == hand[0]) {
+        hand[0] = hand[1];
+    }
+    hand[1] = '-';
+
+    switch (m->discard) {
+        case '1':
+            if (m->target != '-' && m->guess == t->seats[target].hand[0]) {
+                e->dropper = e->out = m->target;
+                e->dropped = m->guess;
+            }
+            break;
+        case '3':
+            if (m->target == '-' || hand[0] == t->seats[target].hand[0]) {
+                break;
+            }
+            e->out = (hand[0] < t->seats[target].hand[0]) ? source : m->target;
+            e->dropper = e->out;
+            e->dropped = t->seats[seat_of(e->out)].hand[0];
+            break;
+        case '4':
+            t->protected |= 1u << t->turn;
+            break;
+        case '5':
+            targetHand = t->seats[target].hand[0];
+            if (targetHand == '8') {
+                e->out = m->target;
+            }
+            card = draw_card(t);
+            if (card == 'E') {
+                card = t->burntCard;
+            }
+            t->seats[target].hand[0] = card;
+            e->replaced[target] = card;
+            e->dropper = m->target;
+            e->dropped = targetHand;
+            break;
+        case '6':
+            if (m->target == '-') {
+                break;
+            }
+            card = t->seats[target].hand[0];
+            t->seats[target].hand[0] = hand[0];
+            hand[0] = card;
+            e->replaced[target] = t->seats[target].hand[0];
+            e->replaced[t->turn] = hand[0];
+            break;
+        case '8':
+            e->dropper = e->out = source;
+            e->dropped = hand[0];
+            break;
+    }
+    set_out(t, e->out);
+
+    t->turn = (t->turn + 1) % t->players;
+    return 0;
+}
+
+/* Lists every valid move the player whose turn it is could make. Every 
+ * guess is as valid as any other, so each card and target is only checked
+ * once.
+ * @params t The table
+ * @params moves Where to put the moves (room for MAX_MOVES)
+ * @return the number of valid moves
+ */
+int engine_valid_moves(struct Table *t, struct Move *moves) {
+    char *hand = t->seats[t->turn].hand;
+    struct Move m;
+    int count = 0, card, target;
+
+    for (card = 0; card < 2; ++card) {
+        if (hand[card] == '-' || (card == 1 && hand[1] == hand[0])) {
+            continue;
+        }
+        m.discard = hand[card];
+        for (target = -1; target < t->players; ++target) {
+            m.target = (target < 0) ? '-' : 'A' + target;
+            m.guess = (m.discard == '1' && target >= 0) ? '1' : '-';
+            if (engine_check_move(t, &m)) {
+                continue;
+            }
+            moves[count++] = m;
+            while (m.guess != '-' && m.guess < '8') {
+                m.guess++;
+                moves[count++] = m;
+            }
+        }
+    }
+    return count;
+}
+
+/* Ends a round: each alive player holding the highest card wins the round
+ * and gets a point.
+ * @params t The table
+ * @params winners Set to a bit per seat that won the round
+ * @return the highest card
+ */
+char engine_end_round(struct Table *t, unsigned int *winners) {
+    char highest = 0;
+    int seat;
+
+    for (seat = 0; seat < t->players; ++seat) {
+        if (((t->alive >> seat) & 1) && t->seats[seat].hand[0] > highest) {
+            highest = t->seats[seat].hand[0];
+        }
+    }
+
+    *winners = 0;
+    for (seat = 0; seat < t->players; ++seat) {
+        if (((t->alive >> seat) & 1) && t->seats[seat].hand[0] == highest) {
+            *winners |= 1u << seat;
+            t->seats[seat].points++;
+        }
+    }
+    return highest;
+}
+
+/* Checks if any player has won the game by reaching WINNING_POINTS
+ * @return 1 if a player has, otherwise 0
+ */
+int engine_game_won(struct Table *t) {
+    int seat;
+
+    for (seat = 0; seat < t->players; ++seat) {
+        if (t->seats[seat].points >= WINNING_POINTS) {
+            return 1;
+        }
+    }
+    return 0;
+}
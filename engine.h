@@ -0,0 +1,76 @@
+/* engine.h - Love Letter rules engine
+ * The rules of the game with no networking or stdio, so they can be used by
+ * the server and played headless (see bench.c).
+ */
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#define MAX_SEATS 4
+#define DECK_SIZE 16
+#define WINNING_POINTS 4
+
+// Most moves a player can choose between on a turn (2 cards, each target 
+// or none, and 8 guesses when a 1 has a target)
+#define MAX_MOVES (2 * (MAX_SEATS + 1) * 8)
+
+/* A player's cards and points. Each seat is one cache line, so a turn only
+ * touches the lines of the players it involves. hand[0] is the card a 
+ * player holds between turns, hand[1] the card drawn on their turn ('-' if 
+ * none).
+ */
+struct TableSeat {
+    int points;
+    char hand[2];
+} __attribute__((aligned(64)));
+
+/* The state of the table during a game. Seat 0 is player A, seat 1 player B
+ * and so on. deck is the deck of the current round: DECK_SIZE cards then
+ * an 'E'.
+ */
+struct Table {
+    int players;
+    int turn;
+    int nextCard;
+    int emptyDeck;
+    unsigned int alive;      // Bit per seat still in the round
+    unsigned int protected;  // Bit per seat protected by a 4 they played
+    char burntCard;
+    char *deck;
+    struct TableSeat seats[MAX_SEATS];
+};
+
+/* A move: the card discarded, the player targeted and the card guessed
+ * ('-' where not used)
+ */
+struct Move {
+    char discard;
+    char target;
+    char guess;
+};
+
+/* What happened as the result of a move (the thishappened message), plus
+ * the card any player was given to replace their hand (0 if none)
+ */
+struct Event {
+    char source;
+    char discard;
+    char target;
+    char guess;
+    char dropper;
+    char dropped;
+    char out;
+    char replaced[MAX_SEATS];
+};
+
+// Function Prototypes
+void engine_new_game(struct Table *t, int players);
+void engine_deal(struct Table *t, char *deck);
+int engine_start_turn(struct Table *t, char *card);
+int engine_check_move(struct Table *t, struct Move *m);
+int engine_apply_move(struct Table *t, struct Move *m, struct Event *e);
+int engine_valid_moves(struct Table *t, struct Move *moves);
+char engine_end_round(struct Table *t, unsigned int *winners);
+int engine_game_won(struct Table *t);
+
+#endif
@@ -0,0 +1,133 @@
+/* histogram.c - Log-linear (HDR style) histograms for the server's metrics
+ */
+
+#include <time.h>
+
+#include "histogram.h"
+
+/* Gets the time on the monotonic clock
+ * @return the time in nanoseconds
+ */
+uint64_t now_nanos(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/* Gets the bucket a value is counted in. Values below HIST_SUB_BUCKETS
+ * have a bucket each; above that the top HIST_SUB_BITS bits after the
+ * leading one pick the bucket within the value's power of two.
+ */
+static int bucket_index(uint64_t value) {
+    int bits;
+
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    bits = 63 - __builtin_clzll(value);
+    if (bits >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    return (bits - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+            ((value >> (bits - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Gets the largest value counted in a bucket
+ */
+static uint64_t bucket_high(int index) {
+    int bits, sub;
+
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+    bits = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    sub = index % HIST_SUB_BUCKETS;
+    return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) <<
+            (bits - HIST_SUB_BITS)) - 1;
+}
+
+/* Adds to a value only ever written by the calling thread
+ */
+static inline void add_value(uint64_t *value, uint64_t amount) {
+    __atomic_store_n(value, *value + amount, __ATOMIC_RELAXED);
+}
+
+/* Records a value. Must only be called by the histogram's thread.
+ */
+void histogram_record(struct Histogram *h, uint64_t value) {
+    add_value(&h->buckets[bucket_index(value)], 1);
+    add_value(&h->count, 1);
+    add_value(&h->sum, value);
+    if (value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+}
+
+/* Adds a histogram (which may be being recorded into) to a total that
+ * belongs to the calling thread
+ */
+void histogram_add(struct Histogram *total, struct Histogram *h) {
+    uint64_t max;
+    int i;
+
+    total->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    total->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (max > total->max) {
+        total->max = max;
+    }
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        total->buckets[i] += __atomic_load_n(&h->buckets[i],
+                __ATOMIC_RELAXED);
+    }
+}
+
+/* Gets the value that percent of the recorded values are at or below (to
+ * the precision of the buckets, and never more than the largest value)
+ * @return the value, or 0 if nothing has been recorded
+ */
+uint64_t histogram_percentile(struct Histogram *h, double percent) {
+    uint64_t count = 0, target, seen = 0;
+    int i;
+
+    // The buckets are counted again as count may not match them exactly
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        count += h->buckets[i];
+    }
+    if (count == 0) {
+        return 0;
+    }
+    target = (uint64_t)(count * percent / 100.0 + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    if (i == HIST_BUCKETS || bucket_high(i) > h->max) {
+        return h->max;
+    }
+    return bucket_high(i);
+}
+
+/* Prints a histogram's count, mean, median, 90th, 99th and 99.9th
+ * percentiles and largest value, one "name.stat,value" line each
+ */
+void print_histogram(FILE *out, char *name, struct Histogram *h) {
+    fprintf(out, "%s.count,%lu\n", name, (unsigned long)h->count);
+    fprintf(out, "%s.mean,%lu\n", name,
+            (unsigned long)(h->count ? h->sum / h->count : 0));
+    fprintf(out, "%s.p50,%lu\n", name,
+            (unsigned long)histogram_percentile(h, 50));
+    fprintf(out, "%s.p90,%lu\n", name,
+            (unsigned long)histogram_percentile(h, 90));
+    fprintf(out, "%s.p99,%lu\n", name,
+            (unsigned long)histogram_percentile(h, 99));
+    fprintf(out, "%s.p999,%lu\n", name,
+            (unsigned long)histogram_percentile(h, 99.9));
+    fprintf(out, "%s.max,%lu\n", name, (unsigned long)h->max);
+}
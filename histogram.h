@@ -0,0 +1,37 @@
+/* histogram.h - Log-linear (HDR style) histograms for the server's metrics
+ * Each power of two is split into HIST_SUB_BUCKETS buckets, so a value is
+ * counted to within 1/16 (about 6%) of itself however large it is, in a
+ * fixed number of buckets. Values of 2^HIST_MAX_BITS or more are counted in
+ * the last bucket.
+ * A histogram has one writer, the thread it belongs to, which records into
+ * it without locks or read-modify-write instructions. Any thread can add
+ * it into a total at the same time: every count is read whole, though a
+ * value being recorded may be missing from some of them.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * (HIST_MAX_BITS - HIST_SUB_BITS + 1))
+
+struct Histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// Function Prototypes
+uint64_t now_nanos(void);
+void histogram_record(struct Histogram *h, uint64_t value);
+void histogram_add(struct Histogram *total, struct Histogram *h);
+uint64_t histogram_percentile(struct Histogram *h, double percent);
+void print_histogram(FILE *out, char *name, struct Histogram *h);
+
+#endif
@@ -0,0 +1,207 @@
+/* names.c - Interned player and game names
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "names.h"
+
+/* Hashes a game or player name (FNV-1a)
+ * @return the hash of the name
+ */
+unsigned int hash_name(char *name) {
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Set up the interned names with no names
+ * @params n The interned names
+ * @params counted 1 for a counted table, 0 for a permanent one
+ */
+void init_names(struct Names *n, int counted) {
+    struct NameShard *shard;
+    int i;
+
+    for (i = 0; i < NAME_SHARDS; ++i) {
+        shard = &n->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->bucketCount = NAME_BUCKETS;
+        shard->buckets = calloc(NAME_BUCKETS, sizeof(struct Name*));
+        shard->size = 0;
+    }
+    init_arena(&n->arena);
+    n->counted = counted;
+    n->nextId = 0;
+    n->count = 0;
+    n->bytes = 0;
+}
+
+/* Doubles the number of buckets in a shard, rehashing its names
+ */
+void grow_names(struct NameShard *shard) {
+    unsigned int newCount = shard->bucketCount * 2, i, bucket;
+    struct Name **buckets = calloc(newCount, sizeof(struct Name*));
+    struct Name *name, *next;
+
+    for (i = 0; i < shard->bucketCount; ++i) {
+        for (name = shard->buckets[i]; name != NULL; name = next) {
+            next = name->next;
+            bucket = (name->hash / NAME_SHARDS) & (newCount - 1);
+            name->next = buckets[bucket];
+            buckets[bucket] = name;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucketCount = newCount;
+}
+
+/* Makes the order key of a name from its first 8 bytes
+ */
+uint64_t order_key(char *name, size_t length) {
+    uint64_t key = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(key); ++i) {
+        key <<= 8;
+        if (i < length) {
+            key |= (unsigned char)name[i];
+        }
+    }
+    return key;
+}
+
+/* Looks a name up in its shard (which the caller has locked)
+ * @return the interned copy, or NULL if it has not been interned
+ */
+static struct Name *lookup_name(struct NameShard *shard, char *name, 
+        unsigned int hash) {
+    struct Name *interned;
+
+    interned = shard->buckets[(hash / NAME_SHARDS) & 
+            (shard->bucketCount - 1)];
+    for (; interned != NULL; interned = interned->next) {
+        if (interned->hash == hash && !strcmp(interned->text, name)) {
+            break;
+        }
+    }
+    return interned;
+}
+
+/* Gets the interned copy of a name, interning it (and giving it the next 
+ * id) if it is new. In a counted table this takes a reference to it.
+ * @params n The interned names
+ * @params name The name
+ * @params hash The hash of the name (from hash_name)
+ * @return the interned copy, which must not be changed. It lasts for the 
+ *      life of the server, or in a counted table until it is released.
+ */
+struct Name *intern_name(struct Names *n, char *name, unsigned int hash) {
+    struct NameShard *shard = &n->shards[hash % NAME_SHARDS];
+    struct Name *interned;
+    unsigned int bucket;
+    size_t length;
+
+    pthread_mutex_lock(&shard->lock);
+    interned = lookup_name(shard, name, hash);
+    if (interned != NULL) {
+        interned->refs++;
+        pthread_mutex_unlock(&shard->lock);
+        return interned;
+    }
+
+    if (shard->size >= shard->bucketCount) {
+        grow_names(shard);
+    }
+    bucket = (hash / NAME_SHARDS) & (shard->bucketCount - 1);
+    length = strlen(name);
+    if (n->counted) {
+        interned = malloc(sizeof(*interned) + length + 1);
+        __atomic_fetch_add(&n->bytes, sizeof(*interned) + length + 1, 
+                __ATOMIC_RELAXED);
+    } else {
+        interned = arena_alloc(&n->arena, sizeof(*interned) + length + 1);
+    }
+    interned->hash = hash;
+    interned->id = __atomic_fetch_add(&n->nextId, 1, __ATOMIC_RELAXED);
+    interned->refs = 1;
+    interned->length = length;
+    interned->orderKey = order_key(name, length);
+    memcpy(interned->text, name, length + 1);
+    interned->next = shard->buckets[bucket];
+    shard->buckets[bucket] = interned;
+    shard->size++;
+    __atomic_fetch_add(&n->count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    return interned;
+}
+
+/* Releases a reference to a name from a counted table, freeing the name if
+ * it was the last. Names in a permanent table are never released.
+ * @params n The interned names
+ * @params name The interned name
+ */
+void release_name(struct Names *n, struct Name *name) {
+    struct NameShard *shard = &n->shards[name->hash % NAME_SHARDS];
+    struct Name **link;
+
+    if (!n->counted) {
+        return;
+    }
+    pthread_mutex_lock(&shard->lock);
+    if (--name->refs > 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    link = &shard->buckets[(name->hash / NAME_SHARDS) & 
+            (shard->bucketCount - 1)];
+    while (*link != name) {
+        link = &(*link)->next;
+    }
+    *link = name->next;
+    shard->size--;
+    __atomic_fetch_sub(&n->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&n->bytes, sizeof(*name) + name->length + 1, 
+            __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    free(name);
+}
+
+/* Gets how many names are interned (in a permanent table, one more than 
+ * the largest id)
+ */
+int name_count(struct Names *n) {
+    return __atomic_load_n(&n->count, __ATOMIC_RELAXED);
+}
+
+/* Gets how much memory the interned names have taken from malloc
+ */
+unsigned long name_bytes(struct Names *n) {
+    struct AllocCounts counts;
+
+    if (n->counted) {
+        return __atomic_load_n(&n->bytes, __ATOMIC_RELAXED);
+    }
+    arena_counts(&n->arena, &counts);
+    return counts.bytes;
+}
+
+/* Compares two interned names from the same table in strcmp order, only 
+ * reading their text when their first 8 bytes are the same
+ * @return less than, equal to or greater than 0 as a is before, the same 
+ *      as or after b
+ */
+int compare_names(struct Name *a, struct Name *b) {
+    if (a == b) {
+        return 0;
+    }
+    if (a->orderKey != b->orderKey) {
+        return (a->orderKey < b->orderKey) ? -1 : 1;
+    }
+    return strcmp(a->text, b->text);
+}
@@ -0,0 +1,67 @@
+/* names.h - Interned player and game names
+ * Each distinct name is stored once, so two interned names from the same 
+ * table are equal exactly when they are the same pointer. In a permanent 
+ * table names are kept in an arena and never freed, so the server can hold
+ * on to them without copying or freeing them, and each gets the next of a
+ * dense run of integer ids (0, 1, 2...). In a counted table each name is 
+ * malloc'd and counts its references: interning takes one, and the name is
+ * freed once every one has been released.
+ */
+
+#ifndef NAMES_H_
+#define NAMES_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define NAME_SHARDS 16
+#define NAME_BUCKETS 64
+
+/* An interned name, in its shard's hash chain. orderKey is the first 8 
+ * bytes of the name (big endian, padded with zeros), so comparing keys 
+ * orders most names the same way strcmp would without reading the text.
+ */
+struct Name {
+    struct Name *next;
+    unsigned int hash;
+    int id;
+    int refs;
+    int length;
+    uint64_t orderKey;
+    char text[];
+};
+
+/* One shard of the interned names (by hash), with its own lock
+ */
+struct NameShard {
+    pthread_mutex_t lock;
+    struct Name **buckets;
+    unsigned int bucketCount;
+    unsigned int size;
+};
+
+/* A table of interned names. nextId is the next id to give a name, count 
+ * how many names are in the table and bytes (in a counted table) the 
+ * memory they take.
+ */
+struct Names {
+    struct NameShard shards[NAME_SHARDS];
+    struct Arena arena;
+    int counted;
+    int nextId;
+    int count;
+    unsigned long bytes;
+};
+
+// Function Prototypes
+unsigned int hash_name(char *name);
+void init_names(struct Names *n, int counted);
+struct Name *intern_name(struct Names *n, char *name, unsigned int hash);
+void release_name(struct Names *n, struct Name *name);
+int name_count(struct Names *n);
+unsigned long name_bytes(struct Names *n);
+int compare_names(struct Name *a, struct Name *b);
+
+#endif
@@ -0,0 +1,226 @@
+/* pool.c - Memory pools for the server's fixed size structures
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// Arena allocations are rounded up to keep everything aligned
+#define ARENA_ALIGN 16
+// Slabs start on a cache line, so objects of a multiple of its size (such 
+// as the games, with their aligned seats) are cache line aligned
+#define SLAB_ALIGN 64
+
+/* A thread's free objects from one pool
+ */
+struct PoolCache {
+    void *free;
+    int count;
+    struct AllocCounts counts;
+};
+
+/* The part of a thread's arena chunk not yet handed out
+ */
+struct ArenaChunk {
+    char *next;
+    char *end;
+    struct AllocCounts counts;
+};
+
+/* Everything a thread keeps for the pools and arenas. Created the first
+ * time a thread allocates, and kept (in a list of every thread's) so their
+ * counts can be added up.
+ */
+struct PoolThread {
+    struct PoolCache caches[MAX_POOLS];
+    struct ArenaChunk chunks[MAX_ARENAS];
+    struct PoolThread *next;
+};
+
+static struct PoolThread *threads = NULL;
+static __thread struct PoolThread *self = NULL;
+static int poolCount = 0, arenaCount = 0;
+
+/* Gets the calling thread's caches, creating them on its first call
+ */
+struct PoolThread *this_thread(void) {
+    struct PoolThread *t = self;
+
+    if (t == NULL) {
+        t = calloc(1, sizeof(*t));
+        t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&threads, &t->next, t, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        self = t;
+    }
+    return t;
+}
+
+/* Adds to a count only ever written by the calling thread
+ */
+static inline void add_count(unsigned long *count, unsigned long amount) {
+    __atomic_store_n(count, *count + amount, __ATOMIC_RELAXED);
+}
+
+/* Set up a pool of objects of a size (at least the size of a pointer).
+ * Pools are made before any threads allocate and are never destroyed. 
+ * Every thread has a cache for each of MAX_POOLS pools, so making one more
+ * aborts rather than overrunning them.
+ */
+void init_pool(struct Pool *p, size_t size) {
+    if (poolCount == MAX_POOLS) {
+        fprintf(stderr, "More than %d pools\n", MAX_POOLS);
+        abort();
+    }
+    p->id = poolCount++;
+    p->size = (size < sizeof(void*)) ? sizeof(void*) : size;
+    pthread_mutex_init(&p->lock, NULL);
+    p->depot = NULL;
+}
+
+/* Refills an empty cache with up to POOL_BATCH objects from the depot, or
+ * a new slab if the depot is empty
+ */
+void refill_cache(struct Pool *p, struct PoolCache *c) {
+    char *slab;
+    void *object;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->depot != NULL && c->count < POOL_BATCH) {
+        object = p->depot;
+        p->depot = *(void**)object;
+        *(void**)object = c->free;
+        c->free = object;
+        c->count++;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (c->count == 0) {
+        if (posix_memalign((void**)&slab, SLAB_ALIGN, POOL_SLAB * p->size)) {
+            abort();
+        }
+        memset(slab, 0, POOL_SLAB * p->size);
+        for (i = POOL_SLAB - 1; i >= 0; --i) {
+            *(void**)(slab + i * p->size) = c->free;
+            c->free = slab + i * p->size;
+        }
+        c->count = POOL_SLAB;
+        add_count(&c->counts.bytes, POOL_SLAB * p->size);
+    }
+}
+
+/* Allocates an object from a pool. The first pointer's worth of a reused
+ * object has been overwritten; the rest is as it was when it was freed.
+ * @return the object
+ */
+void *pool_alloc(struct Pool *p) {
+    struct PoolCache *c = &this_thread()->caches[p->id];
+    void *object;
+
+    if (c->free == NULL) {
+        refill_cache(p, c);
+    }
+    object = c->free;
+    c->free = *(void**)object;
+    c->count--;
+    add_count(&c->counts.allocs, 1);
+    return object;
+}
+
+/* Frees an object back to a pool (from any thread)
+ */
+void pool_free(struct Pool *p, void *object) {
+    struct PoolCache *c = &this_thread()->caches[p->id];
+    void *batch;
+    int i;
+
+    *(void**)object = c->free;
+    c->free = object;
+    c->count++;
+    add_count(&c->counts.frees, 1);
+
+    if (c->count <= 2 * POOL_BATCH) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i < POOL_BATCH; ++i) {
+        batch = c->free;
+        c->free = *(void**)batch;
+        *(void**)batch = p->depot;
+        p->depot = batch;
+    }
+    pthread_mutex_unlock(&p->lock);
+    c->count -= POOL_BATCH;
+}
+
+/* Set up an arena. Arenas are made before any threads allocate, and at 
+ * most MAX_ARENAS can be made (as for init_pool).
+ */
+void init_arena(struct Arena *a) {
+    if (arenaCount == MAX_ARENAS) {
+        fprintf(stderr, "More than %d arenas\n", MAX_ARENAS);
+        abort();
+    }
+    a->id = arenaCount++;
+}
+
+/* Allocates memory that is never freed from an arena
+ * @return the memory (not zeroed)
+ */
+void *arena_alloc(struct Arena *a, size_t size) {
+    struct ArenaChunk *c = &this_thread()->chunks[a->id];
+    char *memory;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    add_count(&c->counts.allocs, 1);
+    if (size > ARENA_CHUNK / 4) {
+        add_count(&c->counts.bytes, size);
+        return malloc(size);
+    }
+    if (c->next == NULL || (size_t)(c->end - c->next) < size) {
+        c->next = malloc(ARENA_CHUNK);
+        c->end = c->next + ARENA_CHUNK;
+        add_count(&c->counts.bytes, ARENA_CHUNK);
+    }
+    memory = c->next;
+    c->next += size;
+    return memory;
+}
+
+/* Adds a thread's counts to a total
+ */
+void add_counts(struct AllocCounts *total, struct AllocCounts *counts) {
+    total->allocs += __atomic_load_n(&counts->allocs, __ATOMIC_RELAXED);
+    total->frees += __atomic_load_n(&counts->frees, __ATOMIC_RELAXED);
+    total->bytes += __atomic_load_n(&counts->bytes, __ATOMIC_RELAXED);
+}
+
+/* Adds up what every thread has allocated from a pool
+ * @params total Set to the totals
+ */
+void pool_counts(struct Pool *p, struct AllocCounts *total) {
+    struct PoolThread *t;
+
+    total->allocs = total->frees = total->bytes = 0;
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL;
+            t = t->next) {
+        add_counts(total, &t->caches[p->id].counts);
+    }
+}
+
+/* Adds up what every thread has allocated from an arena
+ * @params total Set to the totals
+ */
+void arena_counts(struct Arena *a, struct AllocCounts *total) {
+    struct PoolThread *t;
+
+    total->allocs = total->frees = total->bytes = 0;
+    for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL;
+            t = t->next) {
+        add_counts(total, &t->chunks[a->id].counts);
+    }
+}
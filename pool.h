@@ -0,0 +1,57 @@
+/* pool.h - Memory pools for the server's fixed size structures
+ * A Pool hands out objects of one size that can be freed and reused; an
+ * Arena hands out memory that is never freed. Each thread allocates from
+ * its own cache (or chunk), so threads only share a lock when a cache needs
+ * refilling or emptying, POOL_BATCH objects at a time.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define MAX_POOLS 4
+#define MAX_ARENAS 4
+#define POOL_SLAB 64
+#define POOL_BATCH 16
+#define ARENA_CHUNK 65536
+
+/* Counts of what a thread has allocated from a pool or arena. bytes is the
+ * memory taken from malloc. Written only by the owning thread, read by the
+ * admin.
+ */
+struct AllocCounts {
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long bytes;
+};
+
+/* Objects of one size. Objects freed by any thread go to that thread's
+ * cache, then (once it holds more than 2 * POOL_BATCH) back to the depot
+ * shared by every thread. New objects are carved POOL_SLAB at a time from
+ * zeroed memory; reused objects are handed back as they were freed.
+ */
+struct Pool {
+    int id;
+    size_t size;
+    pthread_mutex_t lock;
+    void *depot;
+};
+
+/* Memory that is never freed, handed out from ARENA_CHUNK byte chunks
+ */
+struct Arena {
+    int id;
+};
+
+// Function Prototypes
+void init_pool(struct Pool *p, size_t size);
+void *pool_alloc(struct Pool *p);
+void pool_free(struct Pool *p, void *object);
+void init_arena(struct Arena *a);
+void *arena_alloc(struct Arena *a, size_t size);
+void pool_counts(struct Pool *p, struct AllocCounts *total);
+void arena_counts(struct Arena *a, struct AllocCounts *total);
+
+#endif
@@ -0,0 +1,315 @@
+/* selfplay.c - Plays every deck of a deckfile through the rules engine
+ * with bots on all cores, and reports how often each seat wins and how long
+ * rounds and games last.
+ * Usage: 2310selfplay deckfile [players [repeats [threads [bots [seed]]]]]
+ * Each deck starts repeats games (the following rounds use the decks after
+ * it, looping, as the server does). bots has a strategy letter per seat
+ * (see bot.c), repeating if shorter than the number of players.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "engine.h"
+#include "deck.h"
+#include "bot.h"
+
+#define MAX_THREADS 256
+#define SELFPLAY_CHUNK 64
+#define MAX_GAME_ROUNDS 32
+#define CACHE_LINE 64
+
+/* Counts gathered by one thread, added together at the end. Games can have
+ * more than one winner if they reach WINNING_POINTS in the same round.
+ */
+struct Results {
+    long games;
+    long rounds;
+    long moves;
+    long gameWins[MAX_SEATS];
+    long roundWins[MAX_SEATS];
+    long roundMoves[DECK_SIZE + 1];          // Rounds by number of moves
+    long gameRounds[MAX_GAME_ROUNDS + 1];    // Games by number of rounds
+};
+
+struct SelfPlay;
+
+/* A thread's share of the games: the items from next up to end. Other
+ * threads steal from the share by taking chunks from next too, so the
+ * owner and thieves never hand out the same item.
+ */
+struct Worker {
+    long next;
+    long end;
+    int id;
+    pthread_t thread;
+    struct SelfPlay *sp;
+    struct Results results;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct SelfPlay {
+    struct DeckStore decks;
+    int players;
+    long repeats;
+    unsigned int seed;
+    struct Bot *bots[MAX_SEATS];
+    int threads;
+    struct Worker *workers;
+};
+
+/* Takes a chunk of up to SELFPLAY_CHUNK items from a worker's share
+ * @params w The worker to take from
+ * @params first Set to the first item taken
+ * @params last Set to one past the last item taken
+ * @return 1 if any items were taken, 0 if the share is used up
+ */
+int take_chunk(struct Worker *w, long *first, long *last) {
+    long next;
+
+    if (__atomic_load_n(&w->next, __ATOMIC_RELAXED) >= w->end) {
+        return 0;
+    }
+    next = __atomic_fetch_add(&w->next, SELFPLAY_CHUNK, __ATOMIC_RELAXED);
+    if (next >= w->end) {
+        return 0;
+    }
+    *first = next;
+    *last = (next + SELFPLAY_CHUNK < w->end) ? next + SELFPLAY_CHUNK :
+            w->end;
+    return 1;
+}
+
+/* Gets the next chunk of work for a worker, from its own share first and
+ * then stolen from the other workers'.
+ * @return 1 if there was work, 0 if every share is used up
+ */
+int next_chunk(struct Worker *w, long *first, long *last) {
+    struct SelfPlay *sp = w->sp;
+    int i;
+
+    if (take_chunk(w, first, last)) {
+        return 1;
+    }
+    for (i = 1; i < sp->threads; ++i) {
+        if (take_chunk(&sp->workers[(w->id + i) % sp->threads], first,
+                last)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Plays one game starting at a deck and counts what happened
+ * @params sp The self play settings
+ * @params item The item being played, which picks the first deck and the
+ *      random seed (so the results don't depend on which thread plays it)
+ * @params r The results to add to
+ */
+void play_game(struct SelfPlay *sp, long item, struct Results *r) {
+    struct Move moves[MAX_MOVES];
+    struct Event e;
+    struct Table t;
+    struct Bot *bot;
+    unsigned int winners, seed;
+    uint64_t deck = item / sp->repeats;
+    int rounds = 0, roundMoves, count, seat;
+    char card, cards[DECK_SIZE + 1];
+
+    seed = (sp->seed ^ (unsigned int)(item * 2654435761u)) | 1;
+    engine_new_game(&t, sp->players);
+    while (!engine_game_won(&t)) {
+        unpack_deck(&sp->decks, (deck + rounds) % sp->decks.count, cards);
+        engine_deal(&t, cards);
+        roundMoves = 0;
+        while (!engine_start_turn(&t, &card)) {
+            count = engine_valid_moves(&t, moves);
+            if (count == 0) {
+                // Only a bad deck could leave no valid move
+                break;
+            }
+            bot = sp->bots[t.turn];
+            engine_apply_move(&t, &moves[bot->choose(&t, moves, count,
+                    &seed)], &e);
+            roundMoves++;
+        }
+        engine_end_round(&t, &winners);
+        for (seat = 0; seat < sp->players; ++seat) {
+            r->roundWins[seat] += (winners >> seat) & 1;
+        }
+        r->roundMoves[roundMoves]++;
+        r->moves += roundMoves;
+        rounds++;
+    }
+    for (seat = 0; seat < sp->players; ++seat) {
+        if (t.seats[seat].points >= WINNING_POINTS) {
+            r->gameWins[seat]++;
+        }
+    }
+    r->gameRounds[rounds < MAX_GAME_ROUNDS ? rounds : MAX_GAME_ROUNDS]++;
+    r->rounds += rounds;
+    r->games++;
+}
+
+/* Thread for a worker: plays chunks of games until there are none left
+ */
+void* run_worker(void *arg) {
+    struct Worker *w = arg;
+    long first, last;
+
+    while (next_chunk(w, &first, &last)) {
+        for (; first < last; ++first) {
+            play_game(w->sp, first, &w->results);
+        }
+    }
+    return NULL;
+}
+
+/* Adds one thread's results to the totals
+ */
+void add_results(struct Results *total, struct Results *r) {
+    int i;
+
+    total->games += r->games;
+    total->rounds += r->rounds;
+    total->moves += r->moves;
+    for (i = 0; i < MAX_SEATS; ++i) {
+        total->gameWins[i] += r->gameWins[i];
+        total->roundWins[i] += r->roundWins[i];
+    }
+    for (i = 0; i <= DECK_SIZE; ++i) {
+        total->roundMoves[i] += r->roundMoves[i];
+    }
+    for (i = 0; i <= MAX_GAME_ROUNDS; ++i) {
+        total->gameRounds[i] += r->gameRounds[i];
+    }
+}
+
+/* Prints the win rates of each seat and the distributions of round and
+ * game lengths
+ */
+void print_results(struct SelfPlay *sp, struct Results *r, double seconds) {
+    int i;
+
+    fprintf(stdout, "games,%ld\nrounds,%ld\nmoves,%ld\nthreads,%d\n",
+            r->games, r->rounds, r->moves, sp->threads);
+    fprintf(stdout, "seconds,%.3f\ngames/sec,%.0f\n", seconds,
+            r->games / seconds);
+
+    fprintf(stdout, "seat,bot,games won,win rate,rounds won,round win rate\n");
+    for (i = 0; i < sp->players; ++i) {
+        fprintf(stdout, "%c,%s,%ld,%.4f,%ld,%.4f\n", 'A' + i,
+                sp->bots[i]->name, r->gameWins[i],
+                (double)r->gameWins[i] / r->games, r->roundWins[i],
+                (double)r->roundWins[i] / r->rounds);
+    }
+
+    fprintf(stdout, "moves in round,rounds,fraction\n");
+    for (i = 0; i <= DECK_SIZE; ++i) {
+        if (r->roundMoves[i]) {
+            fprintf(stdout, "%d,%ld,%.4f\n", i, r->roundMoves[i],
+                    (double)r->roundMoves[i] / r->rounds);
+        }
+    }
+
+    fprintf(stdout, "rounds in game,games,fraction\n");
+    for (i = 0; i <= MAX_GAME_ROUNDS; ++i) {
+        if (r->gameRounds[i]) {
+            fprintf(stdout, "%s%d,%ld,%.4f\n",
+                    (i == MAX_GAME_ROUNDS) ? ">=" : "", i, r->gameRounds[i],
+                    (double)r->gameRounds[i] / r->games);
+        }
+    }
+}
+
+/* Exits with the usage message
+ */
+void usage(void) {
+    fprintf(stderr, "Usage: 2310selfplay deckfile [players [repeats "
+            "[threads [bots [seed]]]]]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct SelfPlay sp;
+    struct Results total;
+    struct timespec start, end;
+    char *letters = "r";
+    long items, share;
+    int i, error;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.players = 4;
+    sp.repeats = 1;
+    sp.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    sp.seed = 2310;
+
+    if (argc < 2) {
+        usage();
+    }
+    if (argc > 2) {
+        sp.players = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        sp.repeats = atol(argv[3]);
+    }
+    if (argc > 4) {
+        sp.threads = atoi(argv[4]);
+    }
+    if (argc > 5) {
+        letters = argv[5];
+    }
+    if (argc > 6) {
+        sp.seed = strtoul(argv[6], NULL, 10);
+    }
+    if (sp.players < 2 || sp.players > MAX_SEATS || sp.repeats < 1 ||
+            sp.threads < 1 || sp.threads > MAX_THREADS || *letters == '\0') {
+        usage();
+    }
+    for (i = 0; i < sp.players; ++i) {
+        if ((sp.bots[i] = find_bot(letters[i % strlen(letters)])) == NULL) {
+            usage();
+        }
+    }
+
+    if ((error = load_deckfile(argv[1], &sp.decks))) {
+        fprintf(stderr, (error == DECKFILE_FAIL) ?
+                "Unable to access deckfile\n" : "Error reading deck\n");
+        return error;
+    }
+
+    // Each worker starts with an equal share of the games
+    items = sp.decks.count * sp.repeats;
+    share = (items + sp.threads - 1) / sp.threads;
+    if (posix_memalign((void **)&sp.workers, CACHE_LINE,
+            sp.threads * sizeof(struct Worker))) {
+        return 1;
+    }
+    memset(sp.workers, 0, sp.threads * sizeof(struct Worker));
+    for (i = 0; i < sp.threads; ++i) {
+        sp.workers[i].id = i;
+        sp.workers[i].sp = &sp;
+        sp.workers[i].next = (i * share < items) ? i * share : items;
+        sp.workers[i].end = ((i + 1) * share < items) ? (i + 1) * share :
+                items;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < sp.threads; ++i) {
+        pthread_create(&sp.workers[i].thread, NULL, run_worker,
+                &sp.workers[i]);
+    }
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < sp.threads; ++i) {
+        pthread_join(sp.workers[i].thread, NULL);
+        add_results(&total, &sp.workers[i].results);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    print_results(&sp, &total, (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
+}
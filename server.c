@@ -1,6 +1,8 @@
 /* server.c - Michael Scotson 
  * */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,107 +13,621 @@
 #include <fcntl.h>
 #include <signal.h>
 #include "shared.h"
+#include "engine.h"
+#include "deck.h"
+#include "pool.h"
+#include "names.h"
+#include "histogram.h"
+#include "uring.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <ctype.h>
-#include <netdb.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
-#define MAXHOSTNAMELEN 128
 #define NO_ERROR 0 
 #define BAD_ARGS 1
-#define DECKFILE_FAIL 2
-#define DECK_FAIL 3
 #define BAD_PORT 4
 #define LISTEN_FAIL 5
 #define BAD_SYSTEM 9
 
-
-struct Decks {
-    char card[17];
-    struct Decks *next;
-};
-
-
+#define MAX_WORKERS 64
+#define MAX_EVENTS 64
+#define MOVE_BUFFER 64
+#define ACCEPT_BATCH 64
+#define ACCEPT_BACKOFF 100
+#define LOBBY_BUCKETS 64
+#define STATS_SHARDS 16
+#define STATS_PAGE 1024
+#define STATS_PAGES 64
+#define SKIP_LEVELS 24
+#define SNAPSHOT_TRIES 8
+#define EXPORT_BATCH 256
+#define ADMIN_BUFFER 4096
+#define NAME_LENGTH 256
+#define PORT_LOADERS 2
+#define KEPT_JOBS 64
+#define MAX_SHARDS 64
+#define HANDSHAKE_TIMEOUT 10000
+#define MAX_HANDSHAKE_TIMEOUT 86400000
+#define DRAIN_TIMEOUT 1000
+#define RING_ENTRIES 256
+#define RING_BUFFERS 1024
+#define RING_BUFFER_SIZE 256
+#define RING_HOLD 4
+#define MESSAGE_SIZE 32
+#define SEND_BATCH 32
+#define EVENT_LOG 256
+
+// States of the per game state machine run by the reactor workers
+#define GAME_DEAL 0
+#define GAME_TURN 1
+#define GAME_AWAIT_MOVE 2
+#define GAME_END_OF_ROUND 3
+#define GAME_OVER 4
+
+// States of a port opening job (see struct PortJob)
+#define JOB_QUEUED 0
+#define JOB_LOADING 1
+#define JOB_DONE 2
+
+// What a ring operation is, kept in the low bits of its data (see 
+// ring_worker_loop); the rest is the connection it is for
+#define RING_IGNORE 0
+#define RING_WAKE 1
+#define RING_RECV 2
+#define RING_SEND 3
+#define RING_TAGS 3
+
+// Results of trying to take a move from a player's input buffer
+#define MOVE_READY 0
+#define MOVE_WAIT 1
+#define MOVE_EOF 2
+
+
+/* Statistics for one player. Each player is in the statistics directory 
+ * (at their name's id) from when they first finish a game, and is linked 
+ * into a skip list ordered by name (nextPlayer[0] being the next player 
+ * alphabetically) once that game's results are published. Players are 
+ * never removed.
+ */
 struct Players {
-    struct Players *nextPlayer;
-    char *name;
+    struct Name *name;
+    int linked;
     int roundsWon;
     int gamesWon;
     int gamesPlayed;
+    int level;
+    struct Players *nextPlayer[];
+};
+
+/* The pages of the statistics directory: pages[i] holds the players with 
+ * ids from i * STATS_PAGE, or is NULL if none of them has finished a game.
+ */
+struct Directory {
+    int size;
+    struct Players **pages[];
+};
+
+/* Player statistics, updated as each game ends. Players are found by the 
+ * id of their interned name in a directory of STATS_PAGE player pages, each
+ * page made the first time one of its players finishes a game. Pages are 
+ * looked up without locks. They are made, and the directory doubled when 
+ * an id is past its end, holding directoryLock. A directory that has been 
+ * replaced is kept (in retired), as other threads may still be reading it,
+ * and the pages are shared by every copy. A player is
+ * added to the directory holding locks[id % STATS_SHARDS], so games ending
+ * at the same time rarely wait on each other to do so.
+ * Each game's results are then published as one: holding publishLock, the
+ * counts of all its players are changed (and new players linked into the 
+ * ordered skip list) while version, a sequence lock, is odd. The admin 
+ * copies the players it prints without taking any lock, trying again if 
+ * a game was published meanwhile, so it never sees part of a game. Readers
+ * walk the list safely during an insert, as each link is published (with
+ * release ordering) only after the player it points to is fully set up.
+ */
+struct Stats {
+    pthread_mutex_t locks[STATS_SHARDS];
+    pthread_mutex_t directoryLock;
+    struct Directory *directory;
+    struct Directory *retired[32];
+    int retiredCount;
+    pthread_mutex_t publishLock;
+    unsigned int version;
+    struct Players *headPlayer;
+    struct Arena arena;
+};
+
+/* Hash table (chained, keyed by game name) of the games on a port that are
+ * still waiting for players. Games are evicted as soon as they are full.
+ * Each port has a lobby per shard, each game name always going to the same
+ * lobby, so the port's accept threads only share a lock when their players
+ * are joining games in the same lobby.
+ * The games being played are kept in lobbies of their own (playing, by the
+ * same shards) from when they start until they are over, so spectators can
+ * find them by name.
+ */
+struct Lobby {
+    pthread_mutex_t lock;
+    struct Game **buckets;
+    unsigned int bucketCount;
+    int size;
+};
+
+/* A player that has connected but not yet sent both their name and the 
+ * name of the game they want to join. Their lines are read as they arrive,
+ * by the thread of the listener that accepted them, through a line reader 
+ * that keeps anything sent after the game name for the game. binary is set
+ * if the player asked for the binary protocol, and spectator if they only
+ * want to watch (so send no name). Handshakes are
+ * kept in the order they were accepted, which is also the order their 
+ * deadlines pass.
+ */
+struct Handshake {
+    int fd;
+    int binary;
+    int spectator;
+    int haveName;
+    uint64_t acceptedAt;
+    struct Handshake *older;
+    struct Handshake *newer;
+    char name[NAME_LENGTH + 1];
+    struct LineReader reader;
+};
+
+/* One of a port's listening sockets, with its own thread accepting 
+ * connections on it. With more than one shard the sockets share the port
+ * with SO_REUSEPORT and the kernel spreads new connections between them.
+ * The thread waits (in its own epoll set) on the listening socket and the 
+ * handshakes of the players it has accepted, dropping those that are still
+ * not finished once the server's handshake timeout has passed. While the
+ * server is out of file descriptors the listening socket is taken out of
+ * the set until pausedUntil (0 when it is being waited on).
+ */
+struct Listener {
+    struct Port *port;
+    int fd;
+    int epollFd;
+    uint64_t pausedUntil;
+    struct Handshake *oldest;
+    struct Handshake *newest;
+    unsigned long timedOut;
+    struct Histogram seatTimes;
 };
 
 struct Port {
     struct Port *nextPort;
+    struct Server *server;
     int port;
-    int fd;
+    int shards;
     char *deckfile;
-    struct Decks *firstDeck;
-    struct Game *headGame;
+    struct DeckStore decks;
+    struct Listener *listeners;
+    struct Lobby *lobbies;
+    struct Lobby *playing;
+    int activeGames;
+};
+
+/* A game message, made once and queued for every player it is sent to 
+ * without being copied. refs is the number of references to it (one for 
+ * each queue it is in); the last to give it up frees it. Only the worker 
+ * playing the game touches it, so refs is not atomic.
+ */
+struct Message {
+    int refs;
+    int length;
+    char text[MESSAGE_SIZE];
+};
+
+/* Part of a player's queued output: the unsent bytes of a message, or of
+ * text that outlives the game (message is then NULL)
+ */
+struct Segment {
+    struct Message *message;
+    char *data;
+    int length;
+};
+
+/* A seated player's socket. Bytes are read as epoll reports them readable
+ * and buffered until it is that player's turn. Messages to the player are 
+ * queued (queueHead to queueLength in queue) and sent together, gathered 
+ * into one write, when the game next waits on a player (or is over), so 
+ * each player gets one write per game event.
+ * events is the set the socket is registered with epoll for. binary is
+ * set if the player uses the binary protocol (see shared.h). early is what
+ * the player sent along with their handshake that did not fit in the input
+ * buffer, earlyOffset bytes of its earlyLength already taken; the socket 
+ * is not read until it has all been taken.
+ * With io_uring the socket is instead received from by a multishot recv
+ * (while recvArmed) into the worker's provided buffers. What does not fit 
+ * in the input buffer is held: held buffers, heldHead to heldTail linked 
+ * through the worker's heldNext, the first heldOffset bytes of heldHead 
+ * already taken. recvEof is set once the socket has closed, and eof once 
+ * nothing held is left. starved is set while the connection waits (in 
+ * the worker's starved list, through nextStarved) for a buffer to be given
+ * back after its recv ran out of them. sending is the bytes being sent by 
+ * a ring send (of sendMsg, gathered in sendIov from the front of the 
+ * queue), and ops is the ring operations not yet finished.
+ */
+struct Connection {
+    struct Game *game;
+    int player;
+    int fd;
+    int binary;
+    int eof;
+    int reading;
+    int events;
+    int inLength;
+    char in[MOVE_BUFFER];
+    char *early;
+    int earlyLength;
+    int earlyOffset;
+    struct Segment *queue;
+    int queueHead;
+    int queueLength;
+    int queueCapacity;
+    int ops;
+    int recvArmed;
+    int recvEof;
+    int held;
+    int heldHead;
+    int heldTail;
+    int heldOffset;
+    int starved;
+    struct Connection *nextStarved;
+    int sending;
+    struct msghdr sendMsg;
+    struct iovec sendIov[SEND_BATCH];
+};
+
+/* A client watching a game. next is the event (in the game's event log) to
+ * send it next, offset how much of that event has already been sent. 
+ * Spectators are never read from.
+ */
+struct Spectator {
+    int fd;
+    struct Game *game;
+    uint64_t next;
+    int offset;
+    struct Spectator *nextSpectator;
+};
+
+/* The end of a player's output that their socket would not take when 
+ * their game was released. The drainer thread writes it as the socket 
+ * allows, and closes the socket once it has all been sent, or once 
+ * DRAIN_TIMEOUT milliseconds have passed since the game was released. 
+ * Drains are kept oldest first (older to newer), which is also the order 
+ * their deadlines pass; those handed over but not yet taken by the drainer 
+ * are stacked through older.
+ */
+struct Drain {
+    int fd;
+    char *data;
+    size_t length;
+    size_t sent;
+    uint64_t deadline;
+    struct Drain *older;
+    struct Drain *newer;
+};
+
+/* A reactor thread. Every game is owned by exactly one worker, which is the
+ * only thread that touches the game once it has started. It waits on its 
+ * players' sockets with epoll, or with its own io_uring ring if the server
+ * was started with -u (heldNext and heldLength are then the held input in
+ * each of the ring's buffers, starved the connections waiting for one and 
+ * recycled set once one has been given back). Its metrics are 
+ * only written by the worker, so the admin can read them at any time 
+ * without holding the worker up. The times are in nanoseconds: moveWaits 
+ * from asking a player for a move (yourturn or NO) until it arrives, and
+ * moveTimes to play it. gameMessages and gameBytes are what each game has 
+ * sent its players. spectators is how many clients are watching the 
+ * worker's games, droppedSpectators how many have been dropped for falling
+ * too far behind (or leaving).
+ */
+struct Worker {
+    pthread_t threadId;
+    int epollFd;
+    int wakeFd;
+    pthread_mutex_t lock;
+    struct Game *pending;
+    struct Spectator *pendingSpectators;
+    struct Game *finished;
+    struct Ring *ring;
+    uint64_t wakeCount;
+    int *heldNext;
+    int *heldLength;
+    struct Connection *starved;
+    int recycled;
+    unsigned long turns;
+    unsigned long writes;
+    unsigned long bytesSent;
+    unsigned long invalidMoves;
+    unsigned long spectators;
+    unsigned long droppedSpectators;
+    struct Histogram moveWaits;
+    struct Histogram moveTimes;
+    struct Histogram gameMessages;
+    struct Histogram gameBytes;
 };
 
+/* A player's seat at a game. Seat 0 is player A, seat 1 player B and so on.
+ * The cards and points of each player are kept by the rules engine in the
+ * game's table. Player names are only interned (as name) once the game is 
+ * full, so players who never play don't take up names for good; until 
+ * then waitingName is a copy of the name.
+ */
+struct Seat {
+    struct Name *name;
+    char *waitingName;
+    int fd;
+    int winner;
+};
+
+/* A game, from when its first player joins until it is over. Once it has 
+ * started, every message broadcast to its players is also kept (as text) 
+ * in its event log: the last EVENT_LOG of the eventCount logged, for the 
+ * spectators watching it.
+ */
 struct Game {
     int gameReady;        
-    struct Game *nextGame;
-    char* gameName;
-    int emptyDeck;
-    int nextCard;
+    struct Port *port;
+    struct Game *nextLobby;
+    struct Game *nextPending;
+    struct Worker *worker;
+    int state;
+    struct Name *gameName;
     int players;
-    int alivePlayers;
-    char burntCard;
+    int seated;
     char move[5];
-    struct Decks *currentDeck;   
-
-    char *playerAName;
-    FILE *fromA;
-    FILE *toA;
-    int fdA;
-    int pointsA;
-    char firstCardA;
-    char secondCardA;
-    int winnerA;
-
-    char *playerBName;
-    FILE *fromB;
-    FILE *toB;
-    int fdB;
-    int pointsB;
-    char firstCardB;
-    char secondCardB;
-    int winnerB;
-
-    char *playerCName;
-    FILE *fromC;
-    FILE *toC;
-    int fdC;
-    int pointsC;
-    char firstCardC;
-    char secondCardC;
-    int winnerC;
-
-    char *playerDName;
-    FILE *fromD;
-    FILE *toD;
-    int fdD;
-    int pointsD;
-    char firstCardD;
-    char secondCardD;
-    int winnerD;
+    uint64_t askedAt;
+    unsigned long messages;
+    unsigned long bytesSent;
+    uint64_t deckIndex;
+    char deck[DECK_CARDS + 1];
+    struct Table table;
+    struct Seat seats[MAX_SEATS];
+    struct Connection conn[MAX_SEATS];
+    struct Message *events[EVENT_LOG];
+    uint64_t eventCount;
+    struct Spectator *spectators;
+};
+
+/* One player's statistics, as copied out of the statistics to be printed
+ */
+struct PlayerRow {
+    struct Name *name;
+    int gamesPlayed;
+    int roundsWon;
+    int gamesWon;
+};
+
+/* A connection to the admin port. Commands are read a line at a time and 
+ * handled in order; their replies are queued in the output buffer and 
+ * sent as the socket allows. The next command is not read until the reply
+ * to the last has been sent, or while statistics are being exported. An 
+ * export writes the exportCount players copied into exportRows when it
+ * started, exportNext being the next to write.
+ */
+struct AdminSession {
+    int fd;
+    int events;
+    int closing;
+    struct LineReader reader;
+    char *out;
+    size_t outLength;
+    size_t outSent;
+    size_t outCapacity;
+    char exporting;
+    struct PlayerRow *exportRows;
+    int exportCount;
+    int exportNext;
+    struct timespec exportStarted;
+};
+
+/* A port being opened in the background for the admin 'P' command. A port
+ * loader thread loads the deckfile and listens on the port, and only then 
+ * links the port into the server's ports to start taking connections.
+ * state and result (0 or the error opening the port) are set by the loader
+ * and polled by the admin with the 'J' command. Jobs are kept (newest 
+ * first) so their results can be looked up, until KEPT_JOBS newer jobs 
+ * have finished.
+ */
+struct PortJob {
+    int id;
+    int portNumber;
+    int state;
+    int result;
+    struct Port *port;
+    struct PortJob *next;
+    struct PortJob *nextQueued;
+};
+
+/* How long the admin commands of one type have taken to handle
+ */
+struct CommandStats {
+    long count;
+    long totalMicros;
+    long maxMicros;
 };
 
 struct Server {
     int adminPort;
     int fdAdminPort;
     struct Port *headPort;
-    struct Players *headPlayer;
+    struct Stats stats;
+    struct Pool gamePool;
+    struct Pool handshakePool;
+    struct Pool messagePool;
+    struct Pool spectatorPool;
+    uint64_t handshakeTimeout;
+    int useRing;
+    struct Names playerNames;
+    struct Names gameNames;
+    struct Worker *workers;
+    int workerCount;
+    unsigned int nextWorker;
+    int adminEpollFd;
+    struct CommandStats commandStats[26];
+    pthread_mutex_t portLock;
+    pthread_mutex_t jobLock;
+    pthread_cond_t jobQueued;
+    struct PortJob *jobs;
+    struct PortJob *queueHead;
+    struct PortJob *queueTail;
+    int nextJobId;
+    int shards;
+    int drainEpollFd;
+    int drainWakeFd;
+    pthread_mutex_t drainLock;
+    struct Drain *newDrains;
+    struct Drain *oldestDrain;
+    struct Drain *newestDrain;
+    unsigned long drainsExpired;
 };
 
-struct Port* create_port(void) {
+/* Sets up an empty lobby
+ */
+void init_lobby(struct Lobby *l) {
+    pthread_mutex_init(&l->lock, NULL);
+    l->bucketCount = LOBBY_BUCKETS;
+    l->buckets = calloc(LOBBY_BUCKETS, sizeof(struct Game*));
+    l->size = 0;
+}
+
+/* Gets which of a port's lobbies (and lobbies of games being played) the 
+ * games with a name (of the hash given) are in. The low bits of the hash 
+ * are left to pick the bucket within the lobby.
+ */
+int lobby_shard(struct Port *p, unsigned int hash) {
+    return (hash >> 16) % p->shards;
+}
+
+/* Finds the game waiting for players with the supplied name in the lobby.
+ * Game names are interned, so the same name is always the same pointer.
+ * @return the game or NULL if there is no such game waiting
+ */
+struct Game* find_lobby_game(struct Lobby *l, struct Name *gameName) {
+    struct Game *g = l->buckets[gameName->hash & (l->bucketCount - 1)];
+
+    while (g != NULL) {
+        if (g->gameName == gameName) {
+            return g;
+        }
+        g = g->nextLobby;
+    }
+    return NULL;
+}
+
+/* Finds a game with the supplied name (not interned) in a lobby
+ * @params l The lobby
+ * @params name The game name
+ * @params hash The hash of the name (from hash_name)
+ * @return the game or NULL if there is no such game
+ */
+struct Game* find_game_named(struct Lobby *l, char *name, 
+        unsigned int hash) {
+    struct Game *g = l->buckets[hash & (l->bucketCount - 1)];
+
+    while (g != NULL) {
+        if (g->gameName->hash == hash && !strcmp(g->gameName->text, name)) {
+            return g;
+        }
+        g = g->nextLobby;
+    }
+    return NULL;
+}
+
+/* Doubles the number of buckets in the lobby, rehashing the waiting games
+ */
+void grow_lobby(struct Lobby *l) {
+    unsigned int newCount = l->bucketCount * 2, i, bucket;
+    struct Game **buckets = calloc(newCount, sizeof(struct Game*));
+    struct Game *g, *next;
+
+    for (i = 0; i < l->bucketCount; ++i) {
+        for (g = l->buckets[i]; g != NULL; g = next) {
+            next = g->nextLobby;
+            bucket = g->gameName->hash & (newCount - 1);
+            g->nextLobby = buckets[bucket];
+            buckets[bucket] = g;
+        }
+    }
+    free(l->buckets);
+    l->buckets = buckets;
+    l->bucketCount = newCount;
+}
+
+/* Puts a game that is waiting for players in the lobby
+ */
+void lobby_add(struct Lobby *l, struct Game *g) {
+    unsigned int bucket;
+
+    if (l->size >= l->bucketCount) {
+        grow_lobby(l);
+    }
+    bucket = g->gameName->hash & (l->bucketCount - 1);
+    g->nextLobby = l->buckets[bucket];
+    l->buckets[bucket] = g;
+    __atomic_store_n(&l->size, l->size + 1, __ATOMIC_RELAXED);
+}
+
+/* Evicts a game from the lobby (once it is full)
+ */
+void lobby_remove(struct Lobby *l, struct Game *g) {
+    struct Game **link;
+
+    link = &l->buckets[g->gameName->hash & (l->bucketCount - 1)];
+
+    while (*link != NULL) {
+        if (*link == g) {
+            *link = g->nextLobby;
+            g->nextLobby = NULL;
+            __atomic_store_n(&l->size, l->size - 1, __ATOMIC_RELAXED);
+            return;
+        }
+        link = &(*link)->nextLobby;
+    }
+}
+
+/* Create a Port structure with an empty lobby, an empty lobby of games 
+ * being played (and a listener to be opened) for each of the server's 
+ * shards
+ * @params s The server structure
+ * @params port The port number
+ * @params deckfile The name of the deckfile used by games on the port
+ * @return the new Port structure
+ */
+struct Port* create_port(struct Server *s, int port, char *deckfile) {
     struct Port *p;
+    int i;
+
     p = malloc(sizeof(*p));
     p->nextPort = NULL;
+    p->server = s;
+    p->port = port;
+    p->shards = s->shards;
+    p->deckfile = malloc(strlen(deckfile) + 1);
+    strcpy(p->deckfile, deckfile);
+    memset(&p->decks, 0, sizeof(p->decks));
+    p->activeGames = 0;
+    p->listeners = calloc(p->shards, sizeof(struct Listener));
+    p->lobbies = malloc(p->shards * sizeof(struct Lobby));
+    p->playing = malloc(p->shards * sizeof(struct Lobby));
+    for (i = 0; i < p->shards; ++i) {
+        p->listeners[i].port = p;
+        p->listeners[i].fd = -1;
+        init_lobby(&p->lobbies[i]);
+        init_lobby(&p->playing[i]);
+    }
     return p;
 }
 
@@ -124,7 +640,8 @@ void exit_server(struct Server *s, int status) {
         case NO_ERROR:
             exit(NO_ERROR);
         case BAD_ARGS:
-            fprintf(stderr, "Usage: 2310serv adminport [[port deck]...]\n");
+            fprintf(stderr, "Usage: 2310serv [-s shards] [-t timeout] [-u] "
+                    "adminport [[port deck]...]\n");
             exit(BAD_ARGS);
         case DECKFILE_FAIL:
             fprintf(stderr, "Unable to access deckfile\n");
@@ -138,1047 +655,1895 @@ void exit_server(struct Server *s, int status) {
         case BAD_PORT:
             fprintf(stderr, "Invalid port number\n");
             exit(BAD_PORT);
+        case BAD_SYSTEM:
+            fprintf(stderr, "System call failed\n");
+            exit(BAD_SYSTEM);
     }
 }
 
-/* Flush the file pointers that go to each player
- * @params g The game structure 
- */
-void flush_streams(struct Game *g) {
-    fflush(g->toA);
-    fflush(g->toB);
-    fflush(g->toC);
-    fflush(g->toD);
-}
-
-/*Open a socket, bind to it and listen for connections
- * @return returns a file descriptor for the new connection
+/* Registers a player's socket with the epoll set of the worker owning the
+ * game for the events it needs: readable while there is room to buffer 
+ * moves and writable while there is output the socket would not take.
+ * @params c The connection to update
  */
-int open_listen(struct Server *s, int port) {
-    int fd;  
-    struct sockaddr_in serverAddr;
-    int optVal;
-
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(fd < 0) {
-        exit_server(s, LISTEN_FAIL);
+void update_events(struct Connection *c) {
+    struct epoll_event event;
+    int epollFd = c->game->worker->epollFd;
+
+    event.events = (c->reading ? EPOLLIN : 0) | 
+            (c->queueHead < c->queueLength ? EPOLLOUT : 0);
+    event.data.ptr = c;
+    if (event.events == (unsigned int)c->events) {
+        return;
     }
-
-    optVal = 1;
-    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
-        exit_server(s, LISTEN_FAIL);
+    if (c->events == 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, c->fd, &event);
+    } else if (event.events == 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+    } else {
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &event);
     }
+    c->events = event.events;
+}
 
-    serverAddr.sin_family = AF_INET;    
-    serverAddr.sin_port = htons(port);
-    serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+/* Makes an empty message for a game's players, with one reference (the 
+ * caller's, given up with release_message once it has been queued)
+ */
+struct Message* new_message(struct Game *g) {
+    struct Message *m = pool_alloc(&g->port->server->messagePool);
 
-    if(bind(fd, (struct sockaddr*)&serverAddr, 
-            sizeof(struct sockaddr_in)) < 0) {
-        exit_server(s, LISTEN_FAIL);
-    }
+    m->refs = 1;
+    m->length = 0;
+    return m;
+}
 
-    if(listen(fd, SOMAXCONN) < 0) {
-        exit_server(s, LISTEN_FAIL);
+/* Gives up a reference to a message, freeing it if it was the last
+ */
+void release_message(struct Game *g, struct Message *m) {
+    if (--m->refs == 0) {
+        pool_free(&g->port->server->messagePool, m);
     }
-
-    return fd;
 }
 
-/* Send a game over message to all of the players who are
- * playing in the game
+/* Makes a message from a (printf style) format. Game messages are all far
+ * shorter than MESSAGE_SIZE; anything longer is cut short.
  */
-void game_over(struct Game *g) {
-    fprintf(g->toA, "gameover\n");
-    fprintf(g->toB, "gameover\n");
-
-    if (g->players > 2) {
-        fprintf(g->toC, "gameover\n");
-    }
+struct Message* format_message(struct Game *g, char *format, 
+        va_list args) {
+    struct Message *m = new_message(g);
 
-    if (g->players > 3) {
-        fprintf(g->toD, "gameover\n");
+    m->length = vsnprintf(m->text, MESSAGE_SIZE, format, args);
+    if (m->length >= MESSAGE_SIZE) {
+        m->length = MESSAGE_SIZE - 1;
     }
-    flush_streams(g);    
+    return m;
 }
 
-/* Check to see if a port is valid. If it is not
- * the program will exit.
+/* Makes a binary protocol frame message
+ * @params g The game structure 
+ * @params opcode The message's opcode
+ * @params fields The message's fields (a character each)
  */
-void check_valid_port(struct Server *s, char *portRaw) {
-    int port;
-    char *next;
+struct Message* frame_message(struct Game *g, int opcode, char *fields) {
+    struct Message *m = new_message(g);
 
-    port = strtol(portRaw, &next, 10);
+    m->text[0] = opcode;
+    pack_fields(m->text + 1, FRAME_LENGTH - 1, fields);
+    m->length = FRAME_LENGTH;
+    return m;
+}
 
-    if (*next != '\0' || port < 1 || port > 65535) {
-        exit_server(s, BAD_PORT);
+/* Adds a segment to the end of a player's queued output, making room by 
+ * moving the queue back to the start of its array, or growing the array 
+ * if it is full. Only the segments, never the data, are moved.
+ */
+void queue_segment(struct Connection *c, struct Message *m, char *data, 
+        int length) {
+    struct Segment *segment;
+
+    if (c->queueHead == c->queueLength) {
+        c->queueHead = c->queueLength = 0;
+    }
+    if (c->queueLength == c->queueCapacity) {
+        if (c->queueHead > 0) {
+            memmove(c->queue, c->queue + c->queueHead, 
+                    (c->queueLength - c->queueHead) * sizeof(*c->queue));
+            c->queueLength -= c->queueHead;
+            c->queueHead = 0;
+        } else {
+            c->queueCapacity = c->queueCapacity ? c->queueCapacity * 2 :
+                    SEND_BATCH;
+            c->queue = realloc(c->queue, 
+                    c->queueCapacity * sizeof(*c->queue));
+        }
     }
-
+    segment = &c->queue[c->queueLength++];
+    segment->message = m;
+    segment->data = data;
+    segment->length = length;
 }
 
-/* Check that a deck (supplied as a string) is valid by checking the length
- * then counting to make sure it contains exactly the right number and type
- * of each card.
- * @params g The server structure
- * @params deck A string containing the cards of a deck 
- * @return returns a 1 if invalid, 0 if valid
+/* Queues a message for a player, without copying it: the player's queue 
+ * takes a reference to it until it has been sent. Every message is counted
+ * as one of the game's messages.
  */
-int check_deck (struct Server *s, char *deck) { 
-    int i, ones = 0, twos = 0, threes = 0, fours = 0, fives = 0, sixes = 0,
-            sevens = 0, eights = 0;
+void queue_message(struct Connection *c, struct Message *m) {
+    m->refs++;
+    queue_segment(c, m, m->text, m->length);
+    c->game->messages++;
+}
 
-    if (deck[16] != '\n' || deck[17] != 0) {
-        return DECK_FAIL;
+/* Queues text that lasts as long as the game (such as an interned name) 
+ * for a player, without copying it. Text ending with a newline is counted 
+ * as one of the game's messages.
+ */
+void queue_text(struct Connection *c, char *text, int length) {
+    queue_segment(c, NULL, text, length);
+    if (length > 0 && text[length - 1] == '\n') {
+        c->game->messages++;
     }
+}
 
-    for (i = 0; i < 16; ++i) {
-        if (deck[i] < '1' || deck[i] > '8') {
-            return 1;
+/* Takes the bytes a write has sent from the front of a player's queued 
+ * output, giving up the messages sent in full
+ * @params c The player's connection
+ * @params bytes The number of bytes sent
+ */
+void output_sent(struct Connection *c, size_t bytes) {
+    struct Worker *w = c->game->worker;
+    struct Segment *segment;
+
+    c->game->bytesSent += bytes;
+    __atomic_store_n(&w->bytesSent, w->bytesSent + bytes, __ATOMIC_RELAXED);
+    while (bytes > 0) {
+        segment = &c->queue[c->queueHead];
+        if (bytes < (size_t)segment->length) {
+            segment->data += bytes;
+            segment->length -= bytes;
+            return;
         }
-        switch (deck[i]) {
-            case '1':
-                ones++;
-                break;
-            case '2':
-                twos++;
-                break;
-            case '3':
-                threes++;
-                break;
-            case '4':
-                fours++;
-                break;
-            case '5':
-                fives++;
-                break;
-            case '6':
-                sixes++;
-                break;
-            case '7':
-                sevens++;
-                break;
-            case '8':
-                eights++;
+        bytes -= segment->length;
+        if (segment->message != NULL) {
+            release_message(c->game, segment->message);
         }
+        c->queueHead++;
     }
-    if (ones != 5 || twos != 2 || threes != 2 || fours != 2 || fives != 2 || 
-            sixes != 1 || sevens != 1 || eights != 1) {
-        return DECK_FAIL;
+}
+
+/* Throws away a player's queued output, as they have gone or the game is 
+ * being released
+ */
+void drop_output(struct Connection *c) {
+    for (; c->queueHead < c->queueLength; c->queueHead++) {
+        if (c->queue[c->queueHead].message != NULL) {
+            release_message(c->game, c->queue[c->queueHead].message);
+        }
     }
-    return 0;
+    c->queueHead = c->queueLength = 0;
 }
 
-/* Load the supplied string containing a deck into supplied linked list entry
- * @params deckCards a string with each number referring to a card in the deck
- * @params deck The listed link entry (Decks struct) to load the deck to
+/* Points iovecs at the first SEND_BATCH segments of a player's queued 
+ * output, to be sent with one write
+ * @params c The player's connection
+ * @params iov Set to the segments
+ * @params length Set to the number of bytes in them
+ * @return the number of iovecs used
  */
-void load_deck(char *deckCards, struct Decks *deck) {
-    int i;
+int gather_output(struct Connection *c, struct iovec *iov, size_t *length) {
+    int count;
 
-    for (i = 0; i < 16; ++i) {
-        deck->card[i] = deckCards[i];
+    *length = 0;
+    for (count = 0; count < SEND_BATCH && 
+            c->queueHead + count < c->queueLength; ++count) {
+        iov[count].iov_base = c->queue[c->queueHead + count].data;
+        iov[count].iov_len = c->queue[c->queueHead + count].length;
+        *length += iov[count].iov_len;
     }
-    deck->card[16] = 'E';
-    //deck->nextCard = 0;
+    return count;
 }
 
-/* Create a new deck on the tail end of the decks linked list. The next deck
- * is the head, which creates a looped linked list.
- * @params head a pointer to the head of the decks linked list
- * @return Returns a pointer to the newly created Decks Structure
+/* Queues a (printf style) message for the player supplied
  */
-struct Decks* create_deck(struct Decks *head) {
-    struct Decks *d;
-    d = malloc(sizeof(*d));
-    d->next = head;
-    return d;
+void send_message(struct Game *g, int player, char *format, ...) {
+    struct Message *m;
+    va_list args;
+
+    va_start(args, format);
+    m = format_message(g, format, args);
+    va_end(args);
+    queue_message(&g->conn[player], m);
+    release_message(g, m);
 }
 
-/* Create a Decks structure, load cards to it and put structures
- * into the appropriate Port structure.
- * @return returns 0 if successful or the appropriate error code if not
+/* Queues a game message for the player supplied in the protocol they use:
+ * a frame of the opcode and fields, or the (printf style) text message
  */
-int load_deckfile(struct Server *s, struct Port *currentPort) {
-    char deckCards[18];
-    struct Decks *head, *newDeck, *lastDeck;
-    int i = 0;
+void send_command(struct Game *g, int player, int opcode, char *fields,
+        char *format, ...) {
+    struct Message *m;
+    va_list args;
 
-    FILE *deckfile = fopen(currentPort->deckfile, "r");
-    if (deckfile == NULL) {
-        return DECKFILE_FAIL;
+    if (g->conn[player].binary) {
+        m = frame_message(g, opcode, fields);
+    } else {
+        va_start(args, format);
+        m = format_message(g, format, args);
+        va_end(args);
     }
+    queue_message(&g->conn[player], m);
+    release_message(g, m);
+}
 
-    head = malloc(sizeof(*head));
-    head->next = head;
-    currentPort->firstDeck = head;
-    lastDeck = head;
+/* Adds a message to a game's event log, in place of (and giving up) the 
+ * one logged EVENT_LOG events before it
+ */
+void log_event(struct Game *g, struct Message *m) {
+    struct Message **slot = &g->events[g->eventCount % EVENT_LOG];
 
-    while (fgets(deckCards, 18, deckfile)) { 
-        if (check_deck(s, deckCards)) {
-            return DECK_FAIL;
-        }
-        if (i == 0) {
-            load_deck(deckCards, head);
-            i++;
+    if (g->eventCount >= EVENT_LOG) {
+        release_message(g, *slot);
+    }
+    m->refs++;
+    *slot = m;
+    g->eventCount++;
+}
+
+/* Broadcasts a game message to every player in the game, in the protocol 
+ * each uses, and logs it for spectators. Each form of the message is made 
+ * once (the frame only if a player uses it) and queued for each of them 
+ * without copying.
+ */
+void send_command_all(struct Game *g, int opcode, char *fields, 
+        char *format, ...) {
+    struct Message *text, *frame = NULL;
+    va_list args;
+    int player;
+
+    va_start(args, format);
+    text = format_message(g, format, args);
+    va_end(args);
+    for (player = 0; player < g->players; ++player) {
+        if (!g->conn[player].binary) {
+            queue_message(&g->conn[player], text);
             continue;
         }
-        newDeck = create_deck(head);
-        lastDeck->next = newDeck;
-        load_deck(deckCards, newDeck);
-        lastDeck = newDeck;
-        i++;
+        if (frame == NULL) {
+            frame = frame_message(g, opcode, fields);
+        }
+        queue_message(&g->conn[player], frame);
+    }
+    log_event(g, text);
+    release_message(g, text);
+    if (frame != NULL) {
+        release_message(g, frame);
     }
-    return 0;
 }
 
-/* Gets a new cards from the deck. If the card is 'E', which is a dummy
- * card singling the end of the deck, the deck is set as empty.
- * @params g The game structure 
- * @return the new card selected from the deck
+/* Starts a ring send of a player's queued output, unless one is already 
+ * sending (whatever is queued meanwhile is sent when it finishes). The 
+ * messages being sent stay queued, so referenced, until it finishes.
+ * @params c The player's connection
  */
-char new_card(struct Game *g) {
-    struct Decks *deck;
-    char card;
-    int newCard;
-
-    deck = g->currentDeck;
-    newCard = g->nextCard++;
+void ring_send_output(struct Connection *c) {
+    struct Worker *w = c->game->worker;
+    size_t length;
 
-    card = deck->card[newCard];
+    if (c->sending || c->queueHead == c->queueLength) {
+        return;
+    }
+    memset(&c->sendMsg, 0, sizeof(c->sendMsg));
+    c->sendMsg.msg_iov = c->sendIov;
+    c->sendMsg.msg_iovlen = gather_output(c, c->sendIov, &length);
+    c->sending = length;
+    c->ops++;
+    ring_sendmsg(w->ring, c->fd, &c->sendMsg, (uintptr_t)c | RING_SEND);
+    __atomic_store_n(&w->writes, w->writes + 1, __ATOMIC_RELAXED);
+}
 
-    if (card == 'E') {
-        g->emptyDeck = 1;
+/* Sends as much of a player's queued output as their socket will take, in
+ * one write unless more than SEND_BATCH messages are queued. Anything left
+ * is sent once epoll reports the socket writable.
+ * With io_uring the output is sent by the ring instead, until the game is 
+ * over; then it is written directly, once any ring send has finished.
+ * @params c The player's connection
+ */
+void send_player_output(struct Connection *c) {
+    struct Worker *w = c->game->worker;
+    struct iovec iov[SEND_BATCH];
+    size_t length;
+    ssize_t sent;
+    int count;
+
+    if (w->ring != NULL && c->game->state != GAME_OVER) {
+        ring_send_output(c);
+        return;
+    }
+    while (!c->sending && (count = gather_output(c, iov, &length)) > 0) {
+        do {
+            sent = writev(c->fd, iov, count);
+        } while (sent < 0 && errno == EINTR);
+
+        __atomic_store_n(&w->writes, w->writes + 1, __ATOMIC_RELAXED);
+        if (sent > 0) {
+            output_sent(c, sent);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            // The player has gone, they will be seen as exiting
+            drop_output(c);
+        }
+        if (sent < (ssize_t)length) {
+            return;
+        }
     }
-    return card;
 }
 
-/* Checks if the player supplied is dead. If the player is dead a 1 is 
- * returned, otherwise a 0 is returned.
+/* Sends a spectator as much of the game's event log as their socket will 
+ * take, from the next event they have not been sent, without waiting. 
  * @params g The game structure 
- * @return A 1 if the player is dead, a 0 if alive.
+ * @params sp The spectator
+ * @return 0 if the spectator is keeping up, or 1 if they should be dropped:
+ * they have left, or fallen so far behind that events they have not been 
+ * sent are no longer in the log
  */
-int player_dead(struct Game *g, int player) {
-    switch (player) {
-        case 0:
-            if (g->firstCardA == '!' || g->secondCardA == '!') {
-                return 1;
-            }
-            return 0;
-        case 1:
-            if (g->firstCardB == '!' || g->secondCardB == '!') {
-                return 1;
-            }
-            return 0;
-        case 2:
-            if (g->firstCardC == '!' || g->secondCardC == '!') {
-                return 1;
-            }
-            return 0;
-        case 3:
-            if (g->firstCardD == '!' || g->secondCardD == '!') {
-                return 1;
+int send_spectator(struct Game *g, struct Spectator *sp) {
+    struct iovec iov[SEND_BATCH];
+    struct Message *m;
+    size_t length;
+    ssize_t sent;
+    int count;
+
+    if (g->eventCount - sp->next > EVENT_LOG) {
+        return 1;
+    }
+    while (sp->next < g->eventCount) {
+        length = 0;
+        for (count = 0; count < SEND_BATCH && 
+                sp->next + count < g->eventCount; ++count) {
+            m = g->events[(sp->next + count) % EVENT_LOG];
+            iov[count].iov_base = m->text;
+            iov[count].iov_len = m->length;
+            length += m->length;
+        }
+        iov[0].iov_base = (char*)iov[0].iov_base + sp->offset;
+        iov[0].iov_len -= sp->offset;
+        length -= sp->offset;
+
+        do {
+            sent = writev(sp->fd, iov, count);
+        } while (sent < 0 && errno == EINTR);
+        if (sent < 0) {
+            return (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        if ((size_t)sent < length) {
+            // Their socket is full, what is left is sent after the next event
+            for (count = 0; (size_t)sent >= iov[count].iov_len; ++count) {
+                sent -= iov[count].iov_len;
+                sp->next++;
+                sp->offset = 0;
             }
+            sp->offset += sent;
             return 0;
+        }
+        sp->next += count;
+        sp->offset = 0;
     }
     return 0;
 }
 
-/* Finds the highest value from a supplied list of four characters and 
- * returns this value.
- * @params statusA Card player A was holding, or '!'/'-' if dead/not playing
- * @params statusB Card player B was holding, or '!'/'-' if dead/not playing
- * @params statusC Card player C was holding, or '!'/'-' if dead/not playing
- * @params statusD Card player D was holding, or '!'/'-' if dead/not playing
- * @return returns the highest supplied character
+/* Closes a spectator's connection and frees them
  */
-char find_highest(char statusA, char statusB, char statusC, char statusD) {
-    char i = '9';
+void end_spectator(struct Game *g, struct Spectator *sp) {
+    close(sp->fd);
+    pool_free(&g->port->server->spectatorPool, sp);
+}
 
-    while (i > 0) {
-        if (i == statusA || i == statusB || i == statusC || i == statusD) {
-            return i;
+/* Sends each spectator of the game the events they have not been sent, 
+ * dropping any that have left or can't keep up, so a slow spectator never
+ * holds the game up
+ * @params g The game structure 
+ */
+void send_spectators(struct Game *g) {
+    struct Worker *w = g->worker;
+    struct Spectator **link = &g->spectators, *sp;
+
+    while (*link != NULL) {
+        sp = *link;
+        if (send_spectator(g, sp)) {
+            *link = sp->nextSpectator;
+            end_spectator(g, sp);
+            __atomic_store_n(&w->spectators, w->spectators - 1, 
+                    __ATOMIC_RELAXED);
+            __atomic_store_n(&w->droppedSpectators, w->droppedSpectators + 1,
+                    __ATOMIC_RELAXED);
+        } else {
+            link = &sp->nextSpectator;
         }
-        i--;
     }
-    return 0;
 }
 
-/* Finds the player with the highest card - eliminated players are marked 
- * using '!' which is lower than the numbered cards alive players have.
- * Non playing players are initialised with a '-', which is also lower than
- * any numbered cards.
- * If a player has this card their points are increased and they are 
- * announced as one of the winners.
- * @params g The game structure 
+/* Starts a spectator handed to the worker watching their game, unless it 
+ * is already over: they are sent the game's players, then the events 
+ * still in the log. A spectator who can't take the players straight away 
+ * (their socket is new, so has room) is dropped.
+ * @params sp The spectator
  */
-void print_winner(struct Game *g, char statusA, char statusB, char statusC, 
-        char statusD) {
-    char highest = find_highest(statusA, statusB, statusC, statusD);
-
-    fprintf(stdout, "Round winner(s) holding %c:", highest);
-    
-    if (highest == statusA) {
-        fprintf(stdout, " A");
-        g->pointsA++;
-    }
-    if (highest == statusB) {
-        fprintf(stdout, " B");
-        g->pointsB++;
-    }
-    if (highest == statusC) {
-        fprintf(stdout, " C");
-        g->pointsC++;
+void attach_spectator(struct Spectator *sp) {
+    struct Game *g = sp->game;
+    struct iovec iov[1 + 2 * MAX_SEATS];
+    char header[4] = {'0' + g->players, ' ', '-', '\n'};
+    size_t length = sizeof(header);
+    int seat, count = 0;
+
+    if (g->state == GAME_OVER) {
+        end_spectator(g, sp);
+        return;
     }
-    if (highest == statusD) {
-        fprintf(stdout, " D");
-        g->pointsD++;
+    iov[count].iov_base = header;
+    iov[count++].iov_len = sizeof(header);
+    for (seat = 0; seat < g->players; ++seat) {
+        iov[count].iov_base = g->seats[seat].name->text;
+        iov[count++].iov_len = g->seats[seat].name->length;
+        iov[count].iov_base = "\n";
+        iov[count++].iov_len = 1;
+        length += g->seats[seat].name->length + 1;
+    }
+    if (writev(sp->fd, iov, count) != (ssize_t)length) {
+        end_spectator(g, sp);
+        return;
     }
-    fprintf(stdout, "\n");
-    fflush(stdout);
+
+    sp->next = (g->eventCount > EVENT_LOG) ? g->eventCount - EVENT_LOG : 0;
+    sp->offset = 0;
+    sp->nextSpectator = g->spectators;
+    g->spectators = sp;
+    __atomic_store_n(&g->worker->spectators, g->worker->spectators + 1, 
+            __ATOMIC_RELAXED);
+    send_spectators(g);
 }
 
-/* Sends the scores of each player to all of the players.
+/* Sends the output queued for each player in the game, and the new events
+ * to its spectators. This is the only place game messages are written, 
+ * once the game is waiting on a player or is over.
  * @params g The game structure 
  */
-void send_scores(struct Game *g) {
-    char scores[16];
-    int players = g->players;
- 
-    if (players == 2) {
-        sprintf(scores, "scores %d %d", g->pointsA, g->pointsB);
-    }
-    if (g->players == 3) {
-        sprintf(scores, "scores %d %d %d", g->pointsA, g->pointsB, g->pointsC);
-    }
-    if (g->players == 4) {
-        sprintf(scores, "scores %d %d %d %d", g->pointsA, g->pointsB,
-                g->pointsC, g->pointsD);
-    } 
+void flush_game(struct Game *g) {
+    int player;
 
-    fprintf(g->toA, "%s\n", scores);
-    fprintf(g->toB, "%s\n", scores);
-    if (g->players > 2) {
-        fprintf(g->toC, "%s\n", scores);
+    for (player = 0; player < g->players; ++player) {
+        send_player_output(&g->conn[player]);
+        if (g->state != GAME_OVER && g->worker->ring == NULL) {
+            update_events(&g->conn[player]);
+        }
     }
-    if (g->players > 3) {
-        fprintf(g->toD, "%s\n", scores);
+    if (g->spectators != NULL) {
+        send_spectators(g);
     }
+}
 
-    flush_streams(g);
+/* Send a game over message to all of the players who are
+ * playing in the game
+ */
+void game_over(struct Game *g) {
+    send_command_all(g, OP_GAMEOVER, "", "gameover\n");
 }
 
-/* Gets the next deck ready at the end of a round, prints the winner
- * of the last round and sends the scores to each player. 
- * @params g The game structure 
-  */
-void end_of_round(struct Game *g) {
-    struct Decks *deck;
-    char statusA, statusB, statusC, statusD;
+/* Check to see if a port is valid. If it is not
+ * the program will exit.
+ */
+void check_valid_port(struct Server *s, char *portRaw) {
+    int port;
+    char *next;
 
-    deck = g->currentDeck;
-    g->nextCard = 0;
+    port = strtol(portRaw, &next, 10);
 
-    deck = (deck->next);
+    if (*next != '\0' || port < 1 || port > 65535) {
+        exit_server(s, BAD_PORT);
+    }
 
-    g->currentDeck = deck;
-    g->emptyDeck = 0;
+}
 
-    statusA = g->firstCardA;
-    statusB = g->firstCardB;
-    statusC = g->firstCardC;
-    statusD = g->firstCardD;
+/* Ends the round in the rules engine and announces the winners: the alive
+ * players holding the highest card, who each get a point.
+ * @params g The game structure 
+ */
+void print_winner(struct Game *g) {
+    unsigned int winners;
+    char highest;
+    int seat;
 
-    print_winner(g, statusA, statusB, statusC, statusD);
+    highest = engine_end_round(&g->table, &winners);
 
-    send_scores(g);
+    fprintf(stdout, "Round winner(s) holding %c:", highest);
+    
+    for (seat = 0; seat < g->players; ++seat) {
+        if ((winners >> seat) & 1) {
+            fprintf(stdout, " %c", 'A' + seat);
+        }
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
 }
 
-/* Gets a move from the specified player and puts it in game struct
+/* Sends the scores of each player to all of the players. Scores are never
+ * more than WINNING_POINTS, so each is a single digit field.
  * @params g The game structure 
- * @params player The player to get the move from
- * @return returns a 1 if EOF is reached (player exited) otherwise 0
  */
-int get_move(struct Game *g, int player) {
-    char move[5];
+void send_scores(struct Game *g) {
+    char scores[7 + MAX_SEATS * 12], points[MAX_SEATS + 1];
+    int length, seat;
+ 
+    length = sprintf(scores, "scores");
+    for (seat = 0; seat < g->players; ++seat) {
+        length += sprintf(scores + length, " %d", g->table.seats[seat].points);
+        points[seat] = '0' + g->table.seats[seat].points;
+    }
+    points[g->players] = 0;
 
-    switch (player) {
-        case 0:
-            if (fgets(move, 5, g->fromA) == NULL) {
-                return 1;
-            }
-            move[3] = 'A';
-            break;
-        case 1:
-            if (fgets(move, 5, g->fromB) == NULL) {
-                return 1;
-            }
-            move[3] = 'B';
-            break;
-        case 2:
-            if (fgets(move, 5, g->fromC) == NULL) {
-                return 1;
-            }
-            move[3] = 'C';
-            break;
-        case 3:
-            if (fgets(move, 5, g->fromD) == NULL) {
-                return 1;
-            }
-            move[3] = 'D';
-            break;
+    send_command_all(g, OP_SCORES, points, "%s\n", scores);
+}
+
+/* Moves on to the next deck of the port (looping back to the first) at the
+ * end of a round, prints the winner of the last round and sends the scores
+ * to each player. 
+ * @params g The game structure 
+  */
+void end_of_round(struct Game *g) {
+    if (++g->deckIndex == g->port->decks.count) {
+        g->deckIndex = 0;
     }
-    strncpy(g->move, move, 5);
-    return 0;
 
+    print_winner(g);
+
+    send_scores(g);
 }
 
-/* Moves the second card to the first card position and clears the second card
- * This is only done if the first card was discarded. otherwise second card 
- * only is cleared.
+/* Gives a provided buffer back to a worker's ring, so the recvs waiting 
+ * for one can be started again
+ * @params w The worker
+ * @params buffer The buffer
  */
-void clear_second_card(struct Game *g, char player, char discard) {
-    char firstCard, secondCard;
-    switch (player) {
-        case 'A':
-            firstCard = g->firstCardA;
-            secondCard = g->secondCardA;
-            if (discard == firstCard) {
-                g->firstCardA = secondCard;
-            }
-            g->secondCardA = '-';
-            break;
-        case 'B':
-            firstCard = g->firstCardB;
-            secondCard = g->secondCardB;
-            if (discard == firstCard) {
-                g->firstCardB = secondCard;
-            }
-            g->secondCardB = '-';
-            break;
-        case 'C':
-            firstCard = g->firstCardC;
-            secondCard = g->secondCardC;
-            if (discard == firstCard) {
-                g->firstCardC = secondCard;
-            }
-            g->secondCardC = '-';
-            break;
-        case 'D':
-            firstCard = g->firstCardD;
-            secondCard = g->secondCardD;
-            if (discard == firstCard) {
-                g->firstCardD = secondCard;
-            }
-            g->secondCardD = '-';
-            break;
+void recycle_buffer(struct Worker *w, int buffer) {
+    ring_recycle(w->ring, buffer);
+    w->recycled = 1;
+}
+
+/* Moves as much of a player's held input as will fit into their input 
+ * buffer, giving the ring back each buffer as it is emptied. Once nothing 
+ * is held, the player is seen as exiting if their socket has closed.
+ * @params c The player's connection
+ */
+void ring_refill(struct Connection *c) {
+    struct Worker *w = c->game->worker;
+    int buffer, length;
+
+    while (c->held && c->inLength < MOVE_BUFFER) {
+        buffer = c->heldHead;
+        length = w->heldLength[buffer] - c->heldOffset;
+        if (length > MOVE_BUFFER - c->inLength) {
+            length = MOVE_BUFFER - c->inLength;
+        }
+        memcpy(c->in + c->inLength, ring_buffer(w->ring, buffer) + 
+                c->heldOffset, length);
+        c->inLength += length;
+        c->heldOffset += length;
+        if (c->heldOffset == w->heldLength[buffer]) {
+            c->heldHead = w->heldNext[buffer];
+            c->heldOffset = 0;
+            c->held--;
+            recycle_buffer(w, buffer);
+        }
+    }
+    if (!c->held && c->recvEof) {
+        c->eof = 1;
     }
 }
 
-/* Checks to make sure the card discarded supplied by the player whose turn it
- * is is actually held by the player.
- * @params g The game structure 
- * @params player The player whose hand to check
- * @params discard The card the player discarded to compare against hand
+/* Moves as much of what a player sent with their handshake (and has not 
+ * been taken yet) as will fit into their input buffer
+ * @params c The player's connection
  */
-int check_card_held(struct Game *g, int player, char discard) {
-    char firstCard, secondCard;
+void take_early(struct Connection *c) {
+    int length = c->earlyLength - c->earlyOffset;
 
-    switch (player) {
-        case 0:
-            firstCard = g->firstCardA;
-            secondCard = g->secondCardA;
-            break;
-        case 1:         
-            firstCard = g->firstCardB;
-            secondCard = g->secondCardB;
-            break;
-        case 2:
-            firstCard = g->firstCardC;
-            secondCard = g->secondCardC;
-            break;
-        case 3:
-            firstCard = g->firstCardD;
-            secondCard = g->secondCardD;
-            break;
+    if (length > MOVE_BUFFER - c->inLength) {
+        length = MOVE_BUFFER - c->inLength;
     }
-    if (discard != firstCard && discard != secondCard) {
-        return 1; 
+    memcpy(c->in + c->inLength, c->early + c->earlyOffset, length);
+    c->inLength += length;
+    c->earlyOffset += length;
+    if (c->earlyOffset == c->earlyLength) {
+        free(c->early);
+        c->early = NULL;
     }
-    return 0;
 }
 
-/* Print a NO message to the player supplied
+/* Starts or stops reading a player's connection, so that it is only read 
+ * while there is room to buffer. Input left over from the handshake is 
+ * taken first, and the socket is not read until all of it has been. With
+ * io_uring the player's held input is taken first, and their multishot 
+ * recv started again if it was stopped (for holding too much, or running 
+ * out of buffers) and nothing is held.
+ * @params c The connection to start or stop reading
+ * @params on 1 to start reading, 0 to stop
  */
-void print_no(struct Game *g, int player) {
-    switch (player) {
-        case 0:
-            fprintf(g->toA, "NO\n");
-            break;
-        case 1:
-            fprintf(g->toB, "NO\n");
-            break;
-        case 2:
-            fprintf(g->toC, "NO\n");
-            break;
-        case 3:
-            fprintf(g->toD, "NO\n");
+void set_reading(struct Connection *c, int on) {
+    struct Worker *w = c->game->worker;
+
+    if (on && c->early != NULL) {
+        take_early(c);
+        on = (c->early == NULL);
+    }
+    c->reading = on;
+    if (w->ring == NULL) {
+        update_events(c);
+        return;
+    }
+    if (!on) {
+        return;
+    }
+    ring_refill(c);
+    if (!c->recvArmed && !c->recvEof && !c->held) {
+        c->recvArmed = 1;
+        c->ops++;
+        ring_recv(w->ring, c->fd, (uintptr_t)c | RING_RECV);
     }
-    flush_streams(g);
 }
 
-/* Print a YES message to the player supplied
+/* Takes the next move frame from the input buffer of a player using the 
+ * binary protocol and puts its fields in the game struct. A frame cut 
+ * short by the player exiting is thrown away.
+ * @params g The game structure 
+ * @params c The player's connection
+ * @return MOVE_READY, MOVE_WAIT or MOVE_EOF as for get_move
  */
-void print_yes(struct Game *g, int player) {
-    switch (player) {
-        case 0:
-            fprintf(g->toA, "YES\n");
-            break;
-        case 1:
-            fprintf(g->toB, "YES\n");
-            break;
-        case 2:
-            fprintf(g->toC, "YES\n");
-            break;
-        case 3:
-            fprintf(g->toD, "YES\n");
+int get_move_frame(struct Game *g, struct Connection *c) {
+    if (c->inLength < MOVE_FRAME_LENGTH) {
+        return c->eof ? MOVE_EOF : MOVE_WAIT;
     }
-    flush_streams(g);
+
+    unpack_fields(g->move, c->in, MOVE_FRAME_LENGTH);
+    c->inLength -= MOVE_FRAME_LENGTH;
+    memmove(c->in, c->in + MOVE_FRAME_LENGTH, c->inLength);
+    if (!c->eof) {
+        set_reading(c, 1);
+    }
+    return MOVE_READY;
 }
 
-/* Get the current hand (firstCard) of the specified player, when it is not
- * their turn. 
+/* Takes the next move from the specified player's input buffer and puts it
+ * in game struct. As with fgets(move, 5, ...) a move is everything up to and
+ * including a newline, but at most 4 characters.
  * @params g The game structure 
- * @params player
- * @return The firstCard (hand) of the relevant player. Blank if specified 
- * player is not A,B,C or D: which should not occur.
- */
-char get_hand(struct Game *g, char player) {
-    switch (player) {
-        case 'A':
-            return (g->firstCardA);
-        case 'B':
-            return (g->firstCardB);
-        case 'C':
-            return (g->firstCardC);
-        case 'D':
-            return (g->firstCardD);
-    }
-    return '-';
-}
-
-/* Marks a player as out by setting their cards to '!' and decrements the
- * alive player count by one. If the player supplied is not A, B, C or D
- * no action is taken.
- * @params g The game structure
- * @params out The player to mark as out
- */
-void set_player_out(struct Game *g, char out) {
-    switch (out) {
-        case 'A':
-            g->firstCardA = '!';
-            g->secondCardA = '!';
-            break;
-        case 'B':
-            g->firstCardB = '!';
-            g->secondCardB = '!';
-            break;
-        case 'C':
-            g->firstCardC = '!';
-            g->secondCardC = '!';
-            break;
-        case 'D':
-            g->firstCardD = '!';
-            g->secondCardD = '!';
-            break;
-        default:
-            return;
+ * @params player The player to get the move from
+ * @return MOVE_READY if a move was taken, MOVE_WAIT if the player has not
+ * sent a whole move yet or MOVE_EOF if the player exited
+ */
+int get_move(struct Game *g, int player) {
+    struct Connection *c = &g->conn[player];
+    char move[5], *newline;
+    int length;
+
+    if (c->binary) {
+        return get_move_frame(g, c);
+    }
+    newline = memchr(c->in, '\n', (c->inLength < 4) ? c->inLength : 4);
+    if (newline != NULL) {
+        length = newline - c->in + 1;
+    } else if (c->inLength >= 4) {
+        length = 4;
+    } else if (c->eof && c->inLength > 0) {
+        length = c->inLength;
+    } else if (c->eof) {
+        return MOVE_EOF;
+    } else {
+        return MOVE_WAIT;
+    }
 
+    memset(move, 0, sizeof(move));
+    memcpy(move, c->in, length);
+    c->inLength -= length;
+    memmove(c->in, c->in + length, c->inLength);
+    if (!c->eof) {
+        set_reading(c, 1);
     }
-    g->alivePlayers--;
+
+    memcpy(g->move, move, 5);
+    return MOVE_READY;
 }
 
-/* Sends a thishappened message to all players reporting what happened as a
- * result of the last players turn. '-' is used if a param is N/A. If a 
- * player becomes out then they are set to be out.
- * @params g The game structure 
- * @params source The label of the player whose turn it was
- * @params discard The card discarded by source player
- * @params target The player targeted by the source player. 
- * @params guess The card guessed by the source player. 
- * @params dropper The player who dropped a card as a result of the turn
- * @params dropped The card dropped (by the dropper) as a result of the turn
- * @params out The player who became out due to the turn
+/* Print a NO message to the player supplied, who is asked for another move
  */
-void this_happened(struct Game *g, char source, char discard, char target, 
-        char guess, char dropper, char dropped, char out) {
-    char message[23];
+void print_no(struct Game *g, int player) {
+    struct Worker *w = g->worker;
 
-    sprintf(message, "thishappened %c%c%c%c/%c%c%c\n", source, discard, 
-            target, guess, dropper, dropped, out);
+    send_command(g, player, OP_NO, "", "NO\n");
+    g->askedAt = now_nanos();
+    __atomic_store_n(&w->invalidMoves, w->invalidMoves + 1, 
+            __ATOMIC_RELAXED);
+}
 
-    fprintf(g->toA, "%s", message);
-    fprintf(g->toB, "%s", message);
-    if (g->players > 2) {
-        fprintf(g->toC, "%s", message);
-    }
-    if (g->players > 3) {
-        fprintf(g->toD, "%s", message);
-    }
+/* Print a YES message to the player supplied
+ */
+void print_yes(struct Game *g, int player) {
+    send_command(g, player, OP_YES, "", "YES\n");
+}
+
+/* Sends a thishappened message to all players reporting what happened as a
+ * result of the last players turn ('-' is used if a part is N/A), and 
+ * prints it to stdout.
+ * @params g The game structure 
+ * @params e What happened, from the rules engine
+ */
+void this_happened(struct Game *g, struct Event *e) {
+    char fields[] = {e->source, e->discard, e->target, e->guess, e->dropper,
+            e->dropped, e->out, 0};
 
-    flush_streams(g);
+    send_command_all(g, OP_HAPPENED, fields, 
+            "thishappened %c%c%c%c/%c%c%c\n", e->source, e->discard, 
+            e->target, e->guess, e->dropper, e->dropped, e->out);
 
-    fprintf(stdout, "Player %c discarded %c", source, discard);
+    fprintf(stdout, "Player %c discarded %c", e->source, e->discard);
 
-    if (target != '-') {
-        fprintf(stdout, " aimed at %c", target);
+    if (e->target != '-') {
+        fprintf(stdout, " aimed at %c", e->target);
     }
 
-    if (guess != '-') {
-        fprintf(stdout, " guessing %c", guess);
+    if (e->guess != '-') {
+        fprintf(stdout, " guessing %c", e->guess);
     } 
     fprintf(stdout, ".");
 
-    if (dropped != '-') {
-        fprintf(stdout, " This forced %c to discard %c.", dropper, dropped);
+    if (e->dropped != '-') {
+        fprintf(stdout, " This forced %c to discard %c.", e->dropper, 
+                e->dropped);
     }
 
-    if (out != '-') {
-        fprintf(stdout, " %c was out.", out);
+    if (e->out != '-') {
+        fprintf(stdout, " %c was out.", e->out);
     }
 
     fprintf(stdout, "\n");
     fflush(stdout);
-
-    set_player_out(g, out); 
 }
 
-/* Given a supplied target and source player compares their hands and 
- * sets the lower hand as out. If hands are equal no one is set as out.
- * This is called when a player plays card '3'.
- * The result is then sent to the players with a thishappened message.
+/* Plays the move a player made (held in the game struct) in the rules 
+ * engine. If valid the player is sent a YES, any players whose hand was 
+ * replaced are told their new card and the results of the move are sent to
+ * all players as a thishappened message. If not, the player is sent a NO 
+ * and must make another move.
  * @params g The game structure 
- * @params target the player targeted for comparison by the source player
- * @params source the player who caused this action by player the '3' card
+ * @params player The player who made the move
+ * @return 1 is returned if the move was rejected, otherwise 0
  */
-void get_out(struct Game *g, char target, char source) {
-    char out = '-', nill = '-', hand = 0, discard = '3';
+int process_move(struct Game *g, int player) {
+    struct Move m = {g->move[0], g->move[1], g->move[2]};
+    struct Event e;
+    char card[2] = {0, 0};
+    int seat;
 
-    if (get_hand(g, source) < get_hand(g, target)) {
-        out = source;
-    } else if (get_hand(g, source) > get_hand(g, target)) {
-        out = target;
+    if (engine_apply_move(&g->table, &m, &e)) {
+        print_no(g, player);
+        return 1;
     }
-    if (out != '-') {
-        hand = get_hand(g, out);
-        this_happened(g, source, discard, target, nill, out, hand, out);
-    } else {
-        this_happened(g, source, discard, target, nill, nill, nill, nill);
+    print_yes(g, player);
+
+    for (seat = 0; seat < g->players; ++seat) {
+        if (e.replaced[seat]) {
+            card[0] = e.replaced[seat];
+            send_command(g, seat, OP_REPLACE, card, "replace %c\n", 
+                    card[0]);
+        }
     }
+    this_happened(g, &e);
+    return 0;
+}
+
+/* Sends a yourturn message to the indicated player telling them their card
+ */
+void send_your_turn(struct Game *g, int player, char card) {
+    char fields[] = {card, 0};
+
+    send_command(g, player, OP_YOURTURN, fields, "yourturn %c\n", card);
+    g->askedAt = now_nanos();
 }
 
-/* Sends a replace message to the specified player, their current hand
- * is changed to the card supplied
+/* Starts the turn of the next alive player by giving them a new card. If 
+ * there is only one alive player left or the deck has run out of cards the
+ * round is over instead.
  * @params g The game structure 
- * @params target the player targeted by the replace message
- * @params card the card to replace the targets hand with
  */
-void replace_hand(struct Game *g, char target, char card) {
+void start_turn(struct Game *g) {
+    char card;
 
-    switch (target) {
-        case 'A':
-            g->firstCardA = card;
-            fprintf(g->toA, "replace %c\n", card);
-            break;
-        case 'B':
-            g->firstCardB = card;
-            fprintf(g->toB, "replace %c\n", card);
-            break;
-        case 'C':
-            g->firstCardC = card;
-            fprintf(g->toC, "replace %c\n", card);
-            break;
-        case 'D':
-            g->firstCardD = card;
-            fprintf(g->toD, "replace %c\n", card);
-            break;
+    if (engine_start_turn(&g->table, &card)) {
+        g->state = GAME_END_OF_ROUND;
+        return;
     }
-    flush_streams(g);
+    send_your_turn(g, g->table.turn, card);
+    g->state = GAME_AWAIT_MOVE;
 }
 
-/* Forces a player to discard their hand and take a new card by replacing
- * their current card with a newly drawn card (from deck or the burntCard)
- * If the discard causes a player to drop an eight, they are also set as out
- * A thishappened message is then sent to all players. 
+/* Initiate a new round by dealing the current deck of the port (unpacked
+ * into the game) in the rules engine and
+ * sending each player their card with the newround message.
  * @params g The game structure 
- * @params source the player who forced the discard
- * @params target the player forced to discard their hand
  */
-void discard_hand(struct Game *g, char source, char target) {
-    char hand = get_hand(g, target), discard = '5', nill = '-', out = '-';
-    char newCard;
+void new_round(struct Game *g) {
+    char card[2] = {0, 0};
+    int seat;
 
-    if (target == '-') {
-        this_happened(g, source, discard, nill, nill, nill, nill, nill);
-        return;
+    unpack_deck(&g->port->decks, g->deckIndex, g->deck);
+    engine_deal(&g->table, g->deck);
+   
+    for (seat = 0; seat < g->players; ++seat) {
+        card[0] = g->table.seats[seat].hand[0];
+        send_command(g, seat, OP_NEWROUND, card, "newround %c\n", card[0]);
     }
+}
 
-    if (hand == '8') {
-        out = target;
-    } 
-    
-    newCard = new_card(g);
-    if (newCard == 'E') {
-        newCard = g->burntCard;
-        g->emptyDeck = 1;
+/* Sends the required game information (palyer number and player names) to 
+ * each of the participating players. Only the first line (with the 
+ * player's label) is made for each player; the names are interned, so are
+ * queued without being copied.
+ */
+void send_game_info(struct Game *g) {
+    struct Message *m;
+    int seat, i;
+
+    for (seat = 0; seat < g->players; ++seat) {
+        m = new_message(g);
+        m->text[0] = '0' + g->players;
+        m->text[1] = ' ';
+        m->text[2] = 'A' + seat;
+        m->text[3] = '\n';
+        m->length = 4;
+        queue_message(&g->conn[seat], m);
+        release_message(g, m);
+        for (i = 0; i < g->players; ++i) {
+            queue_text(&g->conn[seat], g->seats[i].name->text, 
+                    g->seats[i].name->length);
+            queue_text(&g->conn[seat], "\n", 1);
+        }
     }
-    
-    replace_hand(g, target, newCard);
-    
-    this_happened(g, source, discard, target, nill, target, hand, out);
-    
 }
 
-/* Swaps the hands of the two supplied players and sends a thishappened
- * message reporting the swap (but not contents of the hands) to all players.
- * @params g The game structure 
- * @params target the player forced to swap
- * @params source the player who initiated the swap
+
+/* Create a new Player struct (from the statistics arena, as players are 
+ * never removed) and indiatlise it to NULL/0 values
+ * @params st The player statistics
+ * @params name The player's name (interned, so not copied)
+ * @params level The number of skip list levels the player is in
+ * @return return a Player Struct
  */
-void swap_hands(struct Game *g, char target, char source) {
-    char discard = '6', nill = '-';
-    char targetHand = get_hand(g, target);
-    char sourceHand = get_hand(g, source);
+struct Players* create_player(struct Stats *st, struct Name *name, 
+        int level) {
+    struct Players *newPlayer;
+
+    newPlayer = arena_alloc(&st->arena, sizeof(*newPlayer) + 
+            level * sizeof(struct Players*));
+
+    newPlayer->name = name;
+    newPlayer->linked = 0;
+    newPlayer->gamesPlayed = 0;
+    newPlayer->roundsWon = 0;
+    newPlayer->gamesWon = 0;
+    newPlayer->level = level;
+    memset(newPlayer->nextPlayer, 0, level * sizeof(struct Players*));
 
-    if (target != '-') {
-        replace_hand(g, target, sourceHand);
-        replace_hand(g, source, targetHand);
+    return newPlayer;
+}
+
+/* Initialise the player statistics with no players
+ */
+void init_stats(struct Stats *st) {
+    int i;
+
+    for (i = 0; i < STATS_SHARDS; ++i) {
+        pthread_mutex_init(&st->locks[i], NULL);
+    }
+    pthread_mutex_init(&st->directoryLock, NULL);
+    st->directory = calloc(1, sizeof(struct Directory) + 
+            STATS_PAGES * sizeof(struct Players**));
+    st->directory->size = STATS_PAGES;
+    st->retiredCount = 0;
+    pthread_mutex_init(&st->publishLock, NULL);
+    st->version = 0;
+    init_arena(&st->arena);
+    st->headPlayer = create_player(st, NULL, SKIP_LEVELS);
+}
+
+/* Picks how many levels of the skip list a new player is in. Each level
+ * up is a quarter as likely.
+ * @return the number of levels
+ */
+int random_level(void) {
+    static __thread unsigned int seed;
+    int level = 1;
+
+    if (seed == 0) {
+        seed = (unsigned int)pthread_self() | 1;
+    }
+    while (level < SKIP_LEVELS && (rand_r(&seed) & 3) == 0) {
+        level++;
     }
+    return level;
+}
 
-    this_happened(g, source, discard, target, nill, nill, nill, nill);
+/* Doubles the statistics directory until it has a page for an id. Must be
+ * called holding the directory lock.
+ */
+void grow_directory(struct Stats *st, int index) {
+    struct Directory *old = st->directory, *directory;
+    int size = old->size;
+
+    while (size <= index) {
+        size *= 2;
+    }
+    directory = calloc(1, sizeof(struct Directory) + 
+            size * sizeof(struct Players**));
+    directory->size = size;
+    memcpy(directory->pages, old->pages, 
+            old->size * sizeof(struct Players**));
+    st->retired[st->retiredCount++] = old;
+    __atomic_store_n(&st->directory, directory, __ATOMIC_RELEASE);
 }
 
-/* Invoked when a player plays an eight (and has card position set to '-')
- * The card that is not '-' is returned.
- * @return the value of the card that's not blank ('-')
+/* Gets the page of the statistics directory holding a player id, making
+ * it (and growing the directory) if it does not exist yet. Players with 
+ * ids on the same page can use different locks, so pages are only made 
+ * holding the directory lock, which is only taken when one is missing.
+ * @return the page
  */
-char get_other_card(struct Game *g, char player) {
-    char firstCard, secondCard;
+struct Players** stats_page(struct Stats *st, int id) {
+    struct Directory *directory;
+    struct Players **page = NULL;
+    int index = id / STATS_PAGE;
 
-    switch (player) {
-        case 'A':
-            firstCard = g->firstCardA;
-            secondCard = g->secondCardA;
-            break;
-        case 'B':
-            firstCard = g->firstCardB;
-            secondCard = g->secondCardB;
-            break;
-        case 'C':
-            firstCard = g->firstCardC;
-            secondCard = g->secondCardC;
-            break;
-        case 'D':
-            firstCard = g->firstCardD;
-            secondCard = g->secondCardD;
-            break;
+    directory = __atomic_load_n(&st->directory, __ATOMIC_ACQUIRE);
+    if (index < directory->size) {
+        page = __atomic_load_n(&directory->pages[index], __ATOMIC_ACQUIRE);
+    }
+    if (page != NULL) {
+        return page;
+    }
+
+    pthread_mutex_lock(&st->directoryLock);
+    if (index >= st->directory->size) {
+        grow_directory(st, index);
     }
-    if (firstCard == '8' && secondCard != '-') {
-        return secondCard;
+    directory = st->directory;
+    page = directory->pages[index];
+    if (page == NULL) {
+        page = calloc(STATS_PAGE, sizeof(struct Players*));
+        __atomic_store_n(&directory->pages[index], page, __ATOMIC_RELEASE);
     }
-    return firstCard;
+    pthread_mutex_unlock(&st->directoryLock);
+    return page;
 }
 
-/* Checks to see if a player is out or not.
- * @return 1 if player is out, a 0 if still alive
+/* Gets the player after p at a level of the skip list. Safe to call 
+ * without the order lock.
  */
-int check_target_out (struct Game *g, char player) {
-    char firstCard, secondCard;
+struct Players* next_player(struct Players *p, int level) {
+    return __atomic_load_n(&p->nextPlayer[level], __ATOMIC_ACQUIRE);
+}
 
-    switch (player) {
-        case 'A':
-            firstCard = g->firstCardA;
-            secondCard = g->secondCardA;
-            break;
-        case 'B':
-            firstCard = g->firstCardB;
-            secondCard = g->secondCardB;
-            break;
-        case 'C':
-            firstCard = g->firstCardC;
-            secondCard = g->secondCardC;
-            break;
-        case 'D':
-            firstCard = g->firstCardD;
-            secondCard = g->secondCardD;
-            break;
+/* Puts a new player into the skip list in name order. Must be called 
+ * holding the publish lock. The player's links are set before it is 
+ * published at each level, bottom level first, so a reader walking the 
+ * list without the lock always sees a whole player.
+ */
+void insert_ordered(struct Stats *st, struct Players *newPlayer) {
+    struct Players *update[SKIP_LEVELS], *current;
+    int i;
+
+    current = st->headPlayer;
+    for (i = SKIP_LEVELS - 1; i >= 0; --i) {
+        while (current->nextPlayer[i] != NULL && compare_names(
+                current->nextPlayer[i]->name, newPlayer->name) < 0) {
+            current = current->nextPlayer[i];
+        }
+        update[i] = current;
     }
-    if (firstCard == '!' || secondCard == '!') {
-        return 1;
+    for (i = 0; i < newPlayer->level; ++i) {
+        newPlayer->nextPlayer[i] = update[i]->nextPlayer[i];
+        __atomic_store_n(&update[i]->nextPlayer[i], newPlayer, 
+                __ATOMIC_RELEASE);
     }
-    return 0;
 }
 
-/* Receives a move from a player and checks to see if it was valid.
- * If valid the results of this move are calculated and printed to stdout
- * and sent to all players as a thishappened message. 
- * @params g The game structure 
- * @params player The player who made the move
- * @return 1 is returned if player exited (get_move hit EOF), otherwise 0
+/* Update the statistics with new information for the player supplied. 
+ * Must be called holding the publish lock, while the version is odd.
  */
-int process_move(struct Game *g, int player) {
-    if (get_move(g, player)) {
-        return 1;
+void update_stats(struct Players *p, int points, int winner) {
+    __atomic_store_n(&p->roundsWon, p->roundsWon + points, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->gamesWon, p->gamesWon + winner, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->gamesPlayed, p->gamesPlayed + 1, __ATOMIC_RELAXED);
+}
+
+/* Gets a player's statistics, adding them to the directory (but not yet 
+ * to the ordered list) if this is the first game they have finished
+ * @params st The player statistics
+ * @params name The player's interned name
+ * @return the player
+ */
+struct Players* find_player(struct Stats *st, struct Name *name) {
+    pthread_mutex_t *lock = &st->locks[name->id % STATS_SHARDS];
+    struct Players **page = stats_page(st, name->id), *p;
+
+    pthread_mutex_lock(lock);
+    p = page[name->id % STATS_PAGE];
+    if (p == NULL) {
+        p = create_player(st, name, random_level());
+        page[name->id % STATS_PAGE] = p;
     }
+    pthread_mutex_unlock(lock);
+    return p;
+}
 
-    char source = g->move[3], discard = g->move[0], target = g->move[1],
-            guess = g->move[2], nill = '-';
+/* Adds the results of a game to the statistics of each of its players, 
+ * publishing them all at once: a reader copying the statistics sees either
+ * none of the game's results or all of them. A player finishing their 
+ * first game is linked into the ordered list here, with their counts 
+ * already set.
+ */
+void add_player_stats(struct Game *g, struct Server *s) {
+    struct Players *players[MAX_SEATS];
+    struct Stats *st = &s->stats;
+    int i;
 
-    while (check_card_held(g, player, discard) || 
-            check_valid_move(source, discard, target, guess, g->players) ||
-            check_target_out(g, target)) {
-        print_no(g, player);
-        if (get_move(g, player)) {
-            return 1;
-        }
-        source = g->move[3]; 
-        discard = g->move[0]; 
-        target = g->move[1];
-        guess = g->move[2];
+    for (i = 0; i < g->players; ++i) {
+        players[i] = find_player(st, g->seats[i].name);
     }
-    print_yes(g, player);
-    clear_second_card(g, source, discard);
 
-    switch (discard) {
-        case '1':
-            if (guess == get_hand(g, target)) {
-                this_happened(g, source, discard, target, guess, target, 
-                        guess, target);
-            } else {
-                this_happened(g, source, discard, target, guess, nill, nill, 
-                        nill);
-            }
-            break;
-        case '3':
-            get_out(g, target, source);
-            break;
-        case '5':
-            discard_hand(g, source, target);
-            break;            
-        case '6':
-            swap_hands(g, target, source);
-            break;
-        case '8':
-            this_happened(g, source, discard, nill, nill, source, 
-                    get_other_card(g, source), source);
-            break;
-        default:
-            this_happened(g, source, discard, nill, nill, nill, nill, nill);
+    pthread_mutex_lock(&st->publishLock);
+    __atomic_store_n(&st->version, st->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < g->players; ++i) {
+        update_stats(players[i], g->table.seats[i].points, 
+                g->seats[i].winner);
+        if (!players[i]->linked) {
+            insert_ordered(st, players[i]);
+            players[i]->linked = 1;
+        }
     }
-    return 0;
+    __atomic_store_n(&st->version, st->version + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&st->publishLock);
 }
 
-/* Sends a yourturn message to the indicated player telling them their card
+/* Prints a message indicating the winners of a game once a player has
+ * reached 4 points and tells the players the game is over.
+ * @params g The game structure 
  */
-void send_your_turn(struct Game *g, int player, char card) {
-    switch (player) {
-        case 0:
-            fprintf(g->toA, "yourturn %c\n", card);
-            g->secondCardA = card;
-            break;
-        case 1: 
-            fprintf(g->toB, "yourturn %c\n", card);
-            g->secondCardB = card;
-            break;
-        case 2:
-            fprintf(g->toC, "yourturn %c\n", card);
-            g->secondCardC = card;
-            break;
-        case 3:
-            fprintf(g->toD, "yourturn %c\n", card);
-            g->secondCardD = card;
-            break;
+void end_game(struct Game *g) {
+    int seat;
+
+    fprintf(stdout, "Winner(s):");
+
+    for (seat = 0; seat < g->players; ++seat) {
+        if (g->table.seats[seat].points == WINNING_POINTS) {
+            fprintf(stdout, " %c", 'A' + seat);
+            g->seats[seat].winner = 1;
+        }
     }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+
+    game_over(g);
 }
 
-/* A turn of the game is repeatedly played until there is only one alive 
- * player left or the deck runs out of cards. Alive players are given a new
- * card in turn and their move is processed.Once a round is over the winner(s)
- * are printed and housekeeping is performed and the next deck readied. 
+/* Takes the game's connections out of the epoll set of the worker owning
+ * the game once the game is over (or cancels their ring operations and 
+ * gives back their held buffers), and takes the game out of its port's 
+ * games being played so no more spectators find it. The game is released 
+ * once the worker has handled the rest of the events it is working through,
+ * as some may be for this game, and every ring operation for it has 
+ * finished.
  * @params g The game structure 
- * @return A 1 is returned if EOF is sent by the player instead of a move
- * otherwise 0 is returned.
  */
-int play_round(struct Game *g) {
-    char card;
+void finish_game(struct Game *g) {
+    struct Lobby *playing = &g->port->playing[lobby_shard(g->port, 
+            g->gameName->hash)];
+    struct Connection *c, **link;
     int player;
 
-    while (g->alivePlayers > 1) { 
-        for (player = 0; player < g->players; ++player) {
-            if (player_dead(g, player)) {
-                continue;
-            }
-            if (g->alivePlayers < 2) {
-                end_of_round(g);
-                return 0;
-            }
-            if (!(g->emptyDeck)) {
-                card = new_card(g);
-            } else {
-                end_of_round(g);
-                return 0;
-            }
-            if (card != 'E') {
-                send_your_turn(g, player, card);		
-                flush_streams(g);
-				
-                if (process_move(g, player)) {
-                    game_over(g);
-                    return 1;
-                }
-            } else {
-                g->emptyDeck = 1;
-                end_of_round(g);
-                return 0;
+    pthread_mutex_lock(&playing->lock);
+    lobby_remove(playing, g);
+    pthread_mutex_unlock(&playing->lock);
+
+    for (player = 0; player < g->players; ++player) {
+        c = &g->conn[player];
+        c->reading = 0;
+        if (c->events) {
+            epoll_ctl(g->worker->epollFd, EPOLL_CTL_DEL, c->fd, NULL);
+            c->events = 0;
+        }
+        if (c->ops) {
+            ring_cancel_fd(g->worker->ring, c->fd, RING_IGNORE);
+        }
+        if (c->starved) {
+            link = &g->worker->starved;
+            while (*link != c) {
+                link = &(*link)->nextStarved;
             }
+            *link = c->nextStarved;
+            c->starved = 0;
+        }
+        for (; c->held; c->held--) {
+            recycle_buffer(g->worker, c->heldHead);
+            c->heldHead = g->worker->heldNext[c->heldHead];
         }
     }
-    end_of_round(g);
-    return 0;
+    g->state = GAME_OVER;
+    g->nextPending = g->worker->finished;
+    g->worker->finished = g;
 }
 
 
-/* Initiate a new round by distributing new cards to the playing players
- * using the newround message and setting the number of alive players to
- * the number of players. Also makes sure to set aside the first card in
- * the deck
+/* Closes the connections of the spectators handed to a worker to watch a
+ * game that is being released, before they have been started. No more can
+ * be handed over once the game is no longer being played.
+ * @params w The worker
+ * @params g The game being released
+ */
+void drop_pending_spectators(struct Worker *w, struct Game *g) {
+    struct Spectator **link, *sp, *dropped = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    link = &w->pendingSpectators;
+    while (*link != NULL) {
+        sp = *link;
+        if (sp->game == g) {
+            *link = sp->nextSpectator;
+            sp->nextSpectator = dropped;
+            dropped = sp;
+        } else {
+            link = &sp->nextSpectator;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    while (dropped != NULL) {
+        sp = dropped;
+        dropped = sp->nextSpectator;
+        end_spectator(g, sp);
+    }
+}
+
+/* Sends a game's spectators the last of its events (if their sockets will 
+ * take them) and closes their connections, and gives up its event log
  * @params g The game structure 
  */
-void new_round(struct Game *g) {
+void release_spectators(struct Game *g) {
+    struct Worker *w = g->worker;
+    struct Spectator *sp;
+    uint64_t event;
 
-    g->burntCard = new_card(g);
-    
-    g->firstCardA = new_card(g);
-    g->firstCardB = new_card(g);
-    g->firstCardC = '-';
-    g->firstCardD = '-';
-    g->secondCardA = '-';
-    g->secondCardB = '-';
-    g->secondCardC = '-';
-    g->secondCardD = '-';
-    g->alivePlayers = g->players;
-   
-    fprintf(g->toA, "newround %c\n", g->firstCardA);
-    fprintf(g->toB, "newround %c\n", g->firstCardB);
+    send_spectators(g);
+    while (g->spectators != NULL) {
+        sp = g->spectators;
+        g->spectators = sp->nextSpectator;
+        end_spectator(g, sp);
+        __atomic_store_n(&w->spectators, w->spectators - 1, 
+                __ATOMIC_RELAXED);
+    }
+    drop_pending_spectators(w, g);
+
+    for (event = 0; event < g->eventCount && event < EVENT_LOG; ++event) {
+        release_message(g, g->events[event]);
+    }
+    g->eventCount = 0;
+}
+
+/* Hands the output a player's socket would not take when their game is 
+ * released to the drainer thread, copied out of the game's messages (which
+ * are released with the game), and wakes it
+ * @params s The server structure
+ * @params c The player's connection
+ */
+void drain_output(struct Server *s, struct Connection *c) {
+    struct Drain *d = malloc(sizeof(*d));
+    uint64_t wake = 1;
+    int i;
 
-    if (g->players > 2) {
-        g->firstCardC = new_card(g);
-        fprintf(g->toC, "newround %c\n", g->firstCardC);
+    d->fd = c->fd;
+    d->length = 0;
+    for (i = c->queueHead; i < c->queueLength; ++i) {
+        d->length += c->queue[i].length;
     }
-    if (g->players > 3) {
-        g->firstCardD = new_card(g);
-        fprintf(g->toD, "newround %c\n", g->firstCardD);
+    d->data = malloc(d->length);
+    d->length = 0;
+    for (i = c->queueHead; i < c->queueLength; ++i) {
+        memcpy(d->data + d->length, c->queue[i].data, c->queue[i].length);
+        d->length += c->queue[i].length;
+    }
+    d->sent = 0;
+    d->deadline = now_nanos() + (uint64_t)DRAIN_TIMEOUT * 1000000;
+    d->newer = NULL;
+
+    pthread_mutex_lock(&s->drainLock);
+    d->older = s->newDrains;
+    s->newDrains = d;
+    pthread_mutex_unlock(&s->drainLock);
+    if (write(s->drainWakeFd, &wake, sizeof(wake)) < 0) {
+        perror("Error waking drainer");
     }
-    flush_streams(g);
 }
 
-/* Sends the required game information (palyer number and player names) to 
- * each of the participating players.
+/* Folds the results of a game that is over into the player statistics, 
+ * sends the players anything left queued for them (handing what their 
+ * socket will not take yet to the drainer, which closes their connection 
+ * once it is sent, and otherwise closing it), closes the connections of 
+ * its spectators, records what the game sent, releases its name and puts the 
+ * game back in the server's pool of games to be reused.
+ * @params g The game structure 
  */
-void send_game_info(struct Game *g) {
-    int playerNo = g->players;
+void release_game(struct Game *g) {
+    struct Server *s = g->port->server;
+    struct Worker *w = g->worker;
+    struct Connection *c;
+    int seat;
+
+    add_player_stats(g, s);
+
+    for (seat = 0; seat < g->players; ++seat) {
+        c = &g->conn[seat];
+        free(c->early);
+        send_player_output(c);
+        if (c->queueHead < c->queueLength) {
+            drain_output(s, c);
+        } else {
+            close(g->seats[seat].fd);
+        }
+        drop_output(c);
+    }
+    release_spectators(g);
 
-    char *playerA = g->playerAName, *playerB = g->playerBName;
-    char *playerC = g->playerCName, *playerD = g->playerDName;
+    histogram_record(&w->gameMessages, g->messages);
+    histogram_record(&w->gameBytes, g->bytesSent);
+    __atomic_fetch_sub(&g->port->activeGames, 1, __ATOMIC_RELAXED);
+    release_name(&s->gameNames, g->gameName);
+    pool_free(&s->gamePool, g);
+}
+
+/* Takes the move a player has sent and plays it, recording how long the 
+ * player took to send it and how long it took to play
+ * @params g The game structure 
+ * @return 1 if the move was rejected, otherwise 0
+ */
+int timed_move(struct Game *g) {
+    struct Worker *w = g->worker;
+    uint64_t received = now_nanos();
+    int rejected;
+
+    histogram_record(&w->moveWaits, received - g->askedAt);
+    rejected = process_move(g, g->table.turn);
+    histogram_record(&w->moveTimes, now_nanos() - received);
+    return rejected;
+}
+
+/* Drives the game state machine (deal, turn, await move, end of round) as 
+ * far as it can go without input from a player. Returns once the game is 
+ * waiting on a player's move or is over. Rounds are played until a player
+ * reaches 4 points, or a player exits.
+ * @params g The game structure 
+ */
+void run_game(struct Game *g) {
+    while (1) {
+        switch (g->state) {
+            case GAME_DEAL:
+                if (engine_game_won(&g->table)) {
+                    end_game(g);
+                    finish_game(g);
+                    break;
+                }
+                new_round(g);
+                g->state = GAME_TURN;
+                break;
+            case GAME_TURN:
+                start_turn(g);
+                break;
+            case GAME_AWAIT_MOVE:
+                switch (get_move(g, g->table.turn)) {
+                    case MOVE_WAIT:
+                        return;
+                    case MOVE_EOF:
+                        game_over(g);
+                        finish_game(g);
+                        break;
+                    default:
+                        if (!timed_move(g)) {
+                            __atomic_store_n(&g->worker->turns, 
+                                    g->worker->turns + 1, __ATOMIC_RELAXED);
+                            g->state = GAME_TURN;
+                        }
+                }
+                break;
+            case GAME_END_OF_ROUND:
+                end_of_round(g);
+                g->state = GAME_DEAL;
+                break;
+            default:
+                return;
+        }
+    }
+}
+
+/* Sets up the connections of a game that has been handed to a worker, sends
+ * the game information to the players and starts the first round.
+ * @params g The game structure 
+ */
+void new_game(struct Game *g) {
+    struct Connection *c;
+    int player;
 
-    if (g->players == 2) {
-        fprintf(g->toA, "%d A\n%s\n%s\n", playerNo, playerA, playerB);
-        fprintf(g->toB, "%d B\n%s\n%s\n", playerNo, playerA, playerB);
+    for (player = 0; player < g->players; ++player) {
+        c = &g->conn[player];
+        c->game = g;
+        c->player = player;
+        c->fd = g->seats[player].fd;
+        c->eof = 0;
+        c->reading = 0;
+        c->events = 0;
+        c->queueHead = 0;
+        c->queueLength = 0;
+        c->ops = 0;
+        c->recvArmed = 0;
+        c->recvEof = 0;
+        c->held = 0;
+        c->starved = 0;
+        c->sending = 0;
+        set_reading(c, 1);
+    }
+    g->messages = 0;
+    g->bytesSent = 0;
+    g->eventCount = 0;
+    g->spectators = NULL;
+
+    engine_new_game(&g->table, g->players);
+    send_game_info(g);
+
+    g->state = GAME_DEAL;
+    run_game(g);
+    flush_game(g);
+}
+
+/* Reads whatever a player has sent into their input buffer, then advances
+ * the game if it was waiting on this player. If the buffer is full, reading
+ * stops until the player's turn takes a move from it.
+ * @params c The connection that epoll reported as readable
+ */
+void read_connection(struct Connection *c) {
+    struct Game *g = c->game;
+    ssize_t bytes;
+
+    if (g->state == GAME_OVER) {
         return;
     }
-    if (g->players == 3) {
-        fprintf(g->toA, "%d A\n%s\n%s\n%s\n", playerNo, playerA, playerB, 
-                playerC);
-        fprintf(g->toB, "%d B\n%s\n%s\n%s\n", playerNo, playerA, playerB, 
-                playerC);
-        fprintf(g->toC, "%d C\n%s\n%s\n%s\n", playerNo, playerA, playerB, 
-                playerC);
+
+    if (c->inLength == MOVE_BUFFER || c->early != NULL) {
+        set_reading(c, 0);
+    } else {
+        bytes = read(c->fd, c->in + c->inLength, MOVE_BUFFER - c->inLength);
+        if (bytes > 0) {
+            c->inLength += bytes;
+        } else if (bytes == 0 || (errno != EAGAIN && errno != EINTR)) {
+            c->eof = 1;
+            set_reading(c, 0);
+        }
+    }
+
+    if (g->state == GAME_AWAIT_MOVE && g->table.turn == c->player) {
+        run_game(g);
+        flush_game(g);
+    }
+}
+
+/* Sends more of a player's queued output once their socket is writable
+ * @params c The connection that epoll reported as writable
+ */
+void write_connection(struct Connection *c) {
+    if (c->game->state == GAME_OVER) {
         return;
     }
-    if (g->players == 4) {
-        fprintf(g->toA, "%d A\n%s\n%s\n%s\n%s\n", playerNo, playerA, playerB, 
-                playerC, playerD);
-        fprintf(g->toB, "%d B\n%s\n%s\n%s\n%s\n", playerNo, playerA, playerB, 
-                playerC, playerD);
-        fprintf(g->toC, "%d C\n%s\n%s\n%s\n%s\n", playerNo, playerA, playerB, 
-                playerC, playerD);
-        fprintf(g->toD, "%d D\n%s\n%s\n%s\n%s\n", playerNo, playerA, playerB,
-                playerC, playerD);
+    send_player_output(c);
+    update_events(c);
+}
+
+/* Takes the games (and spectators) handed to a worker by the accept 
+ * threads and starts them. A spectator is always handed over after their
+ * game, so it has been started by the time they are.
+ * @params w The worker that was woken up
+ */
+void take_pending_games(struct Worker *w) {
+    uint64_t count;
+    struct Game *g, *next;
+    struct Spectator *sp, *nextSpectator;
+
+    // With io_uring the eventfd has already been read by the ring
+    if (w->ring == NULL && read(w->wakeFd, &count, sizeof(count)) < 0) {
+        return;
     }
 
-    flush_streams(g);
+    pthread_mutex_lock(&w->lock);
+    g = w->pending;
+    w->pending = NULL;
+    sp = w->pendingSpectators;
+    w->pendingSpectators = NULL;
+    pthread_mutex_unlock(&w->lock);
 
+    while (g != NULL) {
+        next = g->nextPending;
+        new_game(g);
+        g = next;
+    }
+    while (sp != NULL) {
+        nextSpectator = sp->nextSpectator;
+        attach_spectator(sp);
+        sp = nextSpectator;
+    }
 }
 
+/* Event loop of a reactor worker. Waits for player connections (or the wake
+ * up eventfd, which has no connection) to become readable or writable and 
+ * handles them.
+ * @return doesn't return, but a void pointer is indicated
+ */
+void* worker_loop(void *arg) {
+    struct Worker *w = (struct Worker*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct Game *g;
+    int eventCount, i;
+
+    while (1) {
+        eventCount = epoll_wait(w->epollFd, events, MAX_EVENTS, -1);
+        for (i = 0; i < eventCount; ++i) {
+            if (events[i].data.ptr == NULL) {
+                take_pending_games(w);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                write_connection((struct Connection*)events[i].data.ptr);
+            }
+            if (events[i].events & ~EPOLLOUT) {
+                read_connection((struct Connection*)events[i].data.ptr);
+            }
+        }
+        while (w->finished != NULL) {
+            g = w->finished;
+            w->finished = g->nextPending;
+            release_game(g);
+        }
+    }
+    return NULL;
+}
 
-/* Send game information to players and the play rounds of the game until
- * a player reaches 4 points.
- * When the game is over a message is printed indicating the winners. 
- * @return A void pointer is returned if game finished, or ended early due to 
- * one of the players quiting
+/* Handles a ring recv finishing for a player: anything received is held 
+ * and as much as fits moved into their input buffer, then the game is 
+ * advanced if it was waiting on this player. A player holding more than 
+ * RING_HOLD buffers has their recv cancelled until they catch up, so they
+ * can't use up the buffers every player of the worker shares. A recv that
+ * runs out of buffers is only started again once one is given back.
+ * @params c The player's connection
+ * @params done The finished recv
  */
-void* new_game(void* arg) {
-    struct Game *g = (struct Game*)arg;
+void ring_received(struct Connection *c, struct Completion *done) {
+    struct Worker *w = c->game->worker;
+    struct Game *g = c->game;
 
-    g->gameReady = 0;
+    if (!done->more) {
+        c->recvArmed = 0;
+        c->ops--;
+    }
+    if (g->state == GAME_OVER) {
+        if (done->buffer >= 0) {
+            recycle_buffer(w, done->buffer);
+        }
+        return;
+    }
 
-    send_game_info(g);
+    if (done->result > 0) {
+        w->heldLength[done->buffer] = done->result;
+        if (c->held++) {
+            w->heldNext[c->heldTail] = done->buffer;
+        } else {
+            c->heldHead = done->buffer;
+            c->heldOffset = 0;
+        }
+        c->heldTail = done->buffer;
+        ring_refill(c);
+        if (c->held > RING_HOLD && c->recvArmed) {
+            ring_cancel(w->ring, (uintptr_t)c | RING_RECV, RING_IGNORE);
+        } else if (!c->recvArmed) {
+            // The recv stopped by itself (as when the completion queue 
+            // overflows), so start it again once nothing is held
+            set_reading(c, 1);
+        }
+    } else if (done->result == -ENOBUFS && !c->held && !c->starved) {
+        // Every buffer is in use: wait for one to be given back. A player
+        // holding some is started again once they are taken.
+        c->starved = 1;
+        c->nextStarved = w->starved;
+        w->starved = c;
+    } else if (done->result != -ECANCELED) {
+        c->recvEof = 1;
+        ring_refill(c);
+    }
 
-    while (g->pointsA < 4 && g->pointsB < 4 && g->pointsC < 4 && 
-            g->pointsD < 4) {
-        new_round(g);
-        if (play_round(g)) {
-            return NULL;
+    if (g->state == GAME_AWAIT_MOVE && g->table.turn == c->player) {
+        run_game(g);
+        flush_game(g);
+    }
+}
+
+/* Handles a ring send of a player's output finishing, sending whatever is
+ * left or has been queued since
+ * @params c The player's connection
+ * @params result The bytes sent, or the negative error
+ */
+void ring_sent(struct Connection *c, int result) {
+    c->ops--;
+    c->sending = 0;
+    if (result > 0) {
+        output_sent(c, result);
+    } else if (result != -ECANCELED) {
+        // The player has gone, they will be seen as exiting
+        drop_output(c);
+    }
+    if (c->game->state != GAME_OVER) {
+        ring_send_output(c);
+    }
+}
+
+/* Checks whether every ring operation for a game that is over has finished
+ * @return 1 if they have, 0 if not
+ */
+int game_drained(struct Game *g) {
+    int player;
+
+    for (player = 0; player < g->players; ++player) {
+        if (g->conn[player].ops) {
+            return 0;
         }
     }
+    return 1;
+}
 
-    fprintf(stdout, "Winner(s):");
+/* Starts the recvs of the connections that ran out of buffers again, once
+ * a buffer has been given back since they did
+ * @params w The worker
+ */
+void restart_starved(struct Worker *w) {
+    struct Connection *c, *next;
 
-    if (g->pointsA == 4) {
-        fprintf(stdout, " A");
-        g->winnerA = 1;
+    if (!w->recycled) {
+        return;
     }
-    if (g->pointsB == 4) {
-        fprintf(stdout, " B");
-        g->winnerB = 1;
+    w->recycled = 0;
+    c = w->starved;
+    w->starved = NULL;
+    for (; c != NULL; c = next) {
+        next = c->nextStarved;
+        c->starved = 0;
+        set_reading(c, 1);
     }
-    if (g->pointsC == 4) {
-        fprintf(stdout, " C");
-        g->winnerC = 1;
+}
+
+/* Event loop of a reactor worker using io_uring (-u). Each player's socket
+ * has a multishot recv into the ring's provided buffers, and output is 
+ * sent by the ring, so the operations of every game the worker is playing
+ * are submitted, and their results collected, with one system call. The 
+ * wake up eventfd is read by the ring too. Each operation's data is the 
+ * connection it is for with its kind (RING_RECV...) in the low bits.
+ * @return doesn't return, but a void pointer is indicated
+ */
+void* ring_worker_loop(void *arg) {
+    struct Worker *w = (struct Worker*)arg;
+    struct Completion done;
+    struct Connection *c;
+    struct Game *g, **link;
+
+    ring_read(w->ring, w->wakeFd, &w->wakeCount, sizeof(w->wakeCount), 
+            RING_WAKE);
+    while (1) {
+        if (ring_wait(w->ring) < 0 && errno != EBUSY) {
+            perror("Error waiting on ring");
+        }
+        while (ring_next(w->ring, &done)) {
+            c = (struct Connection*)(uintptr_t)(done.data & ~RING_TAGS);
+            switch (done.data & RING_TAGS) {
+                case RING_WAKE:
+                    take_pending_games(w);
+                    ring_read(w->ring, w->wakeFd, &w->wakeCount, 
+                            sizeof(w->wakeCount), RING_WAKE);
+                    break;
+                case RING_RECV:
+                    ring_received(c, &done);
+                    break;
+                case RING_SEND:
+                    ring_sent(c, done.result);
+                    break;
+            }
+        }
+        restart_starved(w);
+        link = &w->finished;
+        while ((g = *link) != NULL) {
+            if (game_drained(g)) {
+                *link = g->nextPending;
+                release_game(g);
+            } else {
+                link = &g->nextPending;
+            }
+        }
     }
-    if (g->pointsD == 4) {
-        fprintf(stdout, " D");
-        g->winnerD = 1;
+    return NULL;
+}
+
+/* Ends a drain, closing its socket (which takes it out of the drainer's 
+ * epoll set) and freeing it
+ * @params s The server structure
+ * @params d The drain
+ */
+void end_drain(struct Server *s, struct Drain *d) {
+    if (d->older != NULL) {
+        d->older->newer = d->newer;
+    } else {
+        s->oldestDrain = d->newer;
     }
-    fprintf(stdout, "\n");
-    fflush(stdout);
+    if (d->newer != NULL) {
+        d->newer->older = d->older;
+    } else {
+        s->newestDrain = d->older;
+    }
+    close(d->fd);
+    free(d->data);
+    free(d);
+}
 
-    game_over(g);
+/* Writes as much of a drain as its socket will take, ending the drain once
+ * it has all been sent or the player has gone
+ * @params s The server structure
+ * @params d The drain
+ */
+void send_drain(struct Server *s, struct Drain *d) {
+    ssize_t sent;
 
-    flush_streams(g);
+    while (d->sent < d->length) {
+        sent = send(d->fd, d->data + d->sent, d->length - d->sent, 
+                MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (sent <= 0) {
+            break;
+        }
+        d->sent += sent;
+    }
+    end_drain(s, d);
+}
 
+/* Takes the drains handed to the drainer since it last looked, adding them
+ * (oldest first) to the end of its drains and to its epoll set
+ * @params s The server structure
+ */
+void take_drains(struct Server *s) {
+    struct Drain *d, *next, *taken = NULL;
+    struct epoll_event event;
+    uint64_t wakeCount;
+
+    if (read(s->drainWakeFd, &wakeCount, sizeof(wakeCount)) < 0 && 
+            errno != EAGAIN) {
+        perror("Error reading drainer wake up");
+    }
+    pthread_mutex_lock(&s->drainLock);
+    d = s->newDrains;
+    s->newDrains = NULL;
+    pthread_mutex_unlock(&s->drainLock);
+
+    // They were stacked newest first
+    for (; d != NULL; d = next) {
+        next = d->older;
+        d->newer = taken;
+        taken = d;
+    }
+    for (d = taken; d != NULL; d = next) {
+        next = d->newer;
+        d->newer = NULL;
+        d->older = s->newestDrain;
+        if (s->newestDrain != NULL) {
+            s->newestDrain->newer = d;
+        } else {
+            s->oldestDrain = d;
+        }
+        s->newestDrain = d;
+        event.events = EPOLLOUT;
+        event.data.ptr = d;
+        if (epoll_ctl(s->drainEpollFd, EPOLL_CTL_ADD, d->fd, &event) < 0) {
+            end_drain(s, d);
+        }
+    }
+}
+
+/* Ends the drains whose deadline has passed, closing their sockets with 
+ * their output unsent
+ * @return how long until the next deadline in milliseconds (rounded up), or
+ *      -1 if there are no drains left
+ */
+int expire_drains(struct Server *s) {
+    uint64_t now = now_nanos();
+
+    while (s->oldestDrain != NULL) {
+        if (s->oldestDrain->deadline > now) {
+            return (s->oldestDrain->deadline - now + 999999) / 1000000;
+        }
+        end_drain(s, s->oldestDrain);
+        __atomic_store_n(&s->drainsExpired, s->drainsExpired + 1, 
+                __ATOMIC_RELAXED);
+    }
+    return -1;
+}
+
+/* Writes the end of the output of players whose games have been released
+ * as their sockets allow, so a player slow to read still gets the end of 
+ * their game without holding up the worker that played it
+ * @return doesn't return, but a void pointer is indicated
+ */
+void* drain_wait(void *arg) {
+    struct Server *s = (struct Server*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    int eventCount, i, timeout = -1;
+
+    while (1) {
+        eventCount = epoll_wait(s->drainEpollFd, events, MAX_EVENTS, 
+                timeout);
+        for (i = 0; i < eventCount; ++i) {
+            if (events[i].data.ptr == NULL) {
+                take_drains(s);
+            } else {
+                send_drain(s, events[i].data.ptr);
+            }
+        }
+        timeout = expire_drains(s);
+    }
     return NULL;
 }
 
-/* Create a game struct and initiate all of the members of that struct 
- * The game name is set to the name of the game
- * @return a game struct that has been initiated
+/* Starts the drainer thread
  */
-struct Game* create_game(char *gameName) {
+void start_drainer(struct Server *s) {
+    struct epoll_event event;
+    pthread_t threadId;
+
+    pthread_mutex_init(&s->drainLock, NULL);
+    s->newDrains = s->oldestDrain = s->newestDrain = NULL;
+    s->drainsExpired = 0;
+    s->drainEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    s->drainWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (s->drainEpollFd < 0 || s->drainWakeFd < 0 || epoll_ctl(
+            s->drainEpollFd, EPOLL_CTL_ADD, s->drainWakeFd, &event) < 0) {
+        exit_server(s, BAD_SYSTEM);
+    }
+    pthread_create(&threadId, NULL, drain_wait, (void*)s);
+    pthread_detach(threadId);
+}
 
+/* Hands a full game to one of the workers (round robin), which will play it
+ * @params s The server structure
+ * @params g The game to start
+ */
+void start_game(struct Server *s, struct Game *g) {
+    struct Lobby *playing = &g->port->playing[lobby_shard(g->port, 
+            g->gameName->hash)];
+    struct Worker *w;
+    unsigned int next;
+    uint64_t wake = 1;
+
+    next = __atomic_fetch_add(&s->nextWorker, 1, __ATOMIC_RELAXED);
+    w = &s->workers[next % s->workerCount];
+
+    g->gameReady = 0;
+    g->worker = w;
+    __atomic_fetch_add(&g->port->activeGames, 1, __ATOMIC_RELAXED);
+
+    // Spectators can find the game as soon as it is handed over
+    pthread_mutex_lock(&playing->lock);
+    lobby_add(playing, g);
+    pthread_mutex_lock(&w->lock);
+    g->nextPending = w->pending;
+    w->pending = g;
+    pthread_mutex_unlock(&w->lock);
+    pthread_mutex_unlock(&playing->lock);
+
+    if (write(w->wakeFd, &wake, sizeof(wake)) < 0) {
+        perror("Error waking worker");
+    }
+}
+
+/* Creates one reactor worker per online core (up to MAX_WORKERS). Each has
+ * its own epoll instance (or io_uring ring), with an eventfd used to hand 
+ * it new games.
+ * @params s The server structure
+ */
+void start_workers(struct Server *s) {
+    struct epoll_event event;
+    struct Worker *w;
+    void *(*loop)(void*);
+    long cores;
+    int i;
+
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
+    } else if (cores > MAX_WORKERS) {
+        cores = MAX_WORKERS;
+    }
+
+    s->workerCount = cores;
+    s->nextWorker = 0;
+    s->workers = calloc(cores, sizeof(*s->workers));
+
+    for (i = 0; i < s->workerCount; ++i) {
+        w = &s->workers[i];
+        w->pending = NULL;
+        w->finished = NULL;
+        w->starved = NULL;
+        w->recycled = 0;
+        pthread_mutex_init(&w->lock, NULL);
+        if (s->useRing) {
+            // The ring's read of the eventfd waits, so it must block
+            w->wakeFd = eventfd(0, EFD_CLOEXEC);
+            w->ring = ring_create(RING_ENTRIES, RING_BUFFERS, 
+                    RING_BUFFER_SIZE);
+            if (w->ring == NULL) {
+                perror("Error setting up io_uring");
+            }
+            if (w->wakeFd < 0 || w->ring == NULL) {
+                exit_server(s, BAD_SYSTEM);
+            }
+            w->heldNext = malloc(RING_BUFFERS * sizeof(int));
+            w->heldLength = malloc(RING_BUFFERS * sizeof(int));
+            loop = ring_worker_loop;
+        } else {
+            w->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            w->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (w->epollFd < 0 || w->wakeFd < 0) {
+                exit_server(s, BAD_SYSTEM);
+            }
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(w->epollFd, EPOLL_CTL_ADD, w->wakeFd, 
+                    &event) < 0) {
+                exit_server(s, BAD_SYSTEM);
+            }
+            loop = worker_loop;
+        }
+        if (pthread_create(&w->threadId, NULL, loop, (void*)w)) {
+            exit_server(s, BAD_SYSTEM);
+        }
+        pthread_detach(w->threadId);
+    }
+}
+
+/* Create a game struct from the server's pool of games and initiate all of
+ * the members of that struct. A reused game keeps the output buffers of 
+ * its connections (a new one starts with none, as the pool zeroes them).
+ * The game name is set to the name of the game (interned, the game holding
+ * a reference to it until it is released)
+ * @params currentPort The port the game is being played on
+ * @return a game struct that has been initiated
+ */
+struct Game* create_game(struct Port *currentPort, struct Name *gameName) {
+    struct Server *s = currentPort->server;
     struct Game *newGame;
-    newGame = malloc(sizeof(*newGame));
-    newGame->nextGame = NULL;
+
+    newGame = pool_alloc(&s->gamePool);
+    newGame->port = currentPort;
+    newGame->nextLobby = NULL;
+    newGame->nextPending = NULL;
     newGame->gameName = NULL;
 
     if (gameName != NULL) {
@@ -1186,317 +2551,409 @@ struct Game* create_game(char *gameName) {
     }
     newGame->gameReady = 0;
     
-    newGame->emptyDeck = 0;
-    newGame->nextCard = 0;
     newGame->players = 0;
-    newGame->alivePlayers = 0;
-    newGame->playerAName = NULL;
-    newGame->playerBName = NULL;
-    newGame->playerCName = NULL;
-    newGame->playerDName = NULL; 
-    newGame->pointsA = 0;
-    newGame->pointsB = 0;
-    newGame->pointsC = 0;
-    newGame->pointsD = 0;
-    newGame->firstCardA = '-';
-    newGame->firstCardB = '-';
-    newGame->firstCardC = '-';
-    newGame->firstCardD = '-';
-    newGame->secondCardA = '-';
-    newGame->secondCardB = '-';
-    newGame->secondCardC = '-';
-    newGame->secondCardD = '-';
-    newGame->fdA = 0;
-    newGame->fdB = 0;
-    newGame->fdC = 0;
-    newGame->fdD = 0;             
-    newGame->fromA = NULL;
-    newGame->fromB = NULL;
-    newGame->fromC = NULL;
-    newGame->fromD = NULL;
-    newGame->toA = NULL;
-    newGame->toB = NULL;
-    newGame->toC = NULL;
-    newGame->toD = NULL;
-    newGame->winnerA = 0;
-    newGame->winnerB = 0;
-    newGame->winnerC = 0;
-    newGame->winnerD = 0;
+    newGame->seated = 0;
+    memset(newGame->seats, 0, sizeof(newGame->seats));
 
     return newGame;
 }
 
-/* Gets a message (of any size) from the supplied player file stream
- * @return a pointer to a heap allocated message
+/* Sort the seated players by name such that playerA is the lowest value when
+ * all values are compared with strcmp (compare_names, which only reads the 
+ * names when their first 8 bytes match). PlayerB is the next lowest and so 
+ * on.
+ * The whole seat (and the input already read from the player) is moved, so
+ * all the other data associated with each player goes with them.
  */
-char* get_message (FILE *fromPlayer) {
-    int i = 0;
-    char *buffer = calloc(2, sizeof(char));
-    char messagePart;
-
-    while(1) {
-        messagePart = fgetc(fromPlayer);
-
-        if (messagePart == EOF || messagePart == '\n') {
-            i++;
-            break;
+void sort_players(struct Game *sort) {
+    struct Seat seatTemp;
+    struct Connection connTemp;
+    int i, j;
+
+    for (i = 1; i < sort->seated; ++i) {
+        for (j = i; j > 0 && compare_names(sort->seats[j - 1].name, 
+                sort->seats[j].name) > 0; --j) {
+            seatTemp = sort->seats[j];
+            sort->seats[j] = sort->seats[j - 1];
+            sort->seats[j - 1] = seatTemp;
+            connTemp = sort->conn[j];
+            sort->conn[j] = sort->conn[j - 1];
+            sort->conn[j - 1] = connTemp;
         }
+    }
+}
 
-        buffer[i] = messagePart;
-        i++;
+/* Add a new player to the next seat that has not yet been taken in a game.
+ * Anything the player sent after their name and game name is kept as the
+ * start of their input, what does not fit in the input buffer put aside 
+ * until it does. Once the game is full its players' names are 
+ * interned and they are sorted.
+ * @params s The server structure
+ * @params gameWait The game the player is joining
+ * @params reader The line reader the player's names were read with
+ * @params playerName The player's name
+ * @params binary 1 if the player uses the binary protocol, otherwise 0
+ */
+void add_new_player(struct Server *s, struct Game *gameWait, 
+        struct LineReader *reader, char *playerName, int binary) {
+    struct Seat *seat = &gameWait->seats[gameWait->seated];
+    struct Connection *c = &gameWait->conn[gameWait->seated++];
+    int i;
 
-        buffer = realloc(buffer, ((sizeof(char) * 2) + i));
+    seat->waitingName = strdup(playerName);
+    seat->fd = reader->fd;
+    seat->winner = 0;
+
+    c->binary = binary;
+    c->inLength = reader->end - reader->start;
+    c->early = NULL;
+    if (c->inLength > MOVE_BUFFER) {
+        // Kept until the player's moves have made room for it
+        c->earlyLength = c->inLength - MOVE_BUFFER;
+        c->earlyOffset = 0;
+        c->early = malloc(c->earlyLength);
+        memcpy(c->early, reader->buffer + reader->start + MOVE_BUFFER, 
+                c->earlyLength);
+        c->inLength = MOVE_BUFFER;
+    }
+    memcpy(c->in, reader->buffer + reader->start, c->inLength);
+
+    if (gameWait->seated < gameWait->players) {
+        return;
+    }
+    for (i = 0; i < gameWait->seated; ++i) {
+        seat = &gameWait->seats[i];
+        seat->name = intern_name(&s->playerNames, seat->waitingName, 
+                hash_name(seat->waitingName));
+        free(seat->waitingName);
+        seat->waitingName = NULL;
     }
+    gameWait->gameReady = 1;
+    sort_players(gameWait);
+}
 
-    buffer[i] = 0;
+/* Gets the number of players a game is for from the first character of its
+ * name. '2' and '3' are two and three player games, anything else is four.
+ * @return the number of players
+ */
+int get_game_size(char *gameName) {
+    if (gameName[0] == '2') {
+        return 2;
+    } else if (gameName[0] == '3') {
+        return 3;
+    }
+    return 4;
+}
 
-    if (strlen(buffer) == 0) {
-        return NULL;
+/* Adds a player who has sent their name and the name of the game they 
+ * want to that game, creating a new game in the lobby if none with that 
+ * name is waiting. Full games are evicted from the lobby. How long the 
+ * player took to be seated from being accepted is recorded by the listener.
+ * @params listener The listener the player connected to
+ * @params h The player's finished handshake
+ * @params line The game name
+ * @return the game if the player filled it, otherwise NULL
+ */
+struct Game* add_to_game(struct Listener *listener, struct Handshake *h, 
+        char *line) {
+    struct Port *currentPort = listener->port;
+    struct Server *s = currentPort->server;
+    struct Name *gameName;
+    struct Lobby *lobby;
+    struct Game *game;
+
+    // The game holds the reference to its name taken here, so a player 
+    // joining a game that is already waiting gives theirs back
+    gameName = intern_name(&s->gameNames, line, hash_name(line));
+
+    lobby = &currentPort->lobbies[lobby_shard(currentPort, gameName->hash)];
+    pthread_mutex_lock(&lobby->lock);
+    game = find_lobby_game(lobby, gameName);
+
+    if (game == NULL) {
+        game = create_game(currentPort, gameName);
+        game->players = get_game_size(gameName->text);
+        lobby_add(lobby, game);
+    } else {
+        release_name(&s->gameNames, gameName);
     }
 
-    return buffer;
+    add_new_player(s, game, &h->reader, h->name, h->binary);
+
+    if (game->gameReady) {
+        lobby_remove(lobby, game);
+    } else {
+        game = NULL;
+    }
+    pthread_mutex_unlock(&lobby->lock);
+    histogram_record(&listener->seatTimes, now_nanos() - h->acceptedAt);
+    return game;
 }
 
-/* Get the number of players who participated in a game
- * @return the number of players who participated in a game
+/* Takes a handshake out of its listener's handshakes and frees it. The 
+ * socket is closed if drop is set, otherwise it is left open (for a game)
+ * but no longer waited on by the listener.
  */
-int get_player_no(struct Game *g) {
-    int playerNo = 0;
+void end_handshake(struct Listener *listener, struct Handshake *h, 
+        int drop) {
+    struct Server *s = listener->port->server;
 
-    if (g->playerAName != NULL) {
-        playerNo++;
-    }
-    if (g->playerBName != NULL) {
-        playerNo++;
+    if (h->older != NULL) {
+        h->older->newer = h->newer;
+    } else {
+        listener->oldest = h->newer;
     }
-    if (g->playerCName != NULL) {
-        playerNo++;
+    if (h->newer != NULL) {
+        h->newer->older = h->older;
+    } else {
+        listener->newest = h->older;
     }
-    if (g->playerDName != NULL) {
-        playerNo++;
+    if (drop) {
+        close(h->fd);
+    } else {
+        epoll_ctl(listener->epollFd, EPOLL_CTL_DEL, h->fd, NULL);
     }
-    return playerNo;
+    pool_free(&s->handshakePool, h);
 }
 
-/* Put player information back into the game struct in alphabetical order
- * This information was sorted by a the function that calls this function
+/* Hands a spectator to the worker playing the game they want to watch (a
+ * game with the name given being played on the port, if there are several).
+ * If there is no such game their connection is closed.
+ * @params p The port the spectator connected to
+ * @params gameName The name of the game (not interned)
+ * @params fd The spectator's socket
  */
-void put_sorted_players_back(struct Game *sort, char **names, FILE **from, 
-        FILE **to, int *fd) {
-    sort->playerAName = names[0]; //Function to put theseBack
-    sort->playerBName = names[1];
-    sort->playerCName = names[2];
-    sort->playerDName = names[3];
-
-    sort->fromA = from[0];
-    sort->fromB = from[1];
-    sort->fromC = from[2];
-    sort->fromD = from[3];
-
-    sort->toA = to[0];
-    sort->toB = to[1];
-    sort->toC = to[2];
-    sort->toD = to[3];
+void watch_game(struct Port *p, char *gameName, int fd) {
+    unsigned int hash = hash_name(gameName);
+    struct Lobby *playing = &p->playing[lobby_shard(p, hash)];
+    struct Spectator *sp;
+    struct Game *g;
+    uint64_t wake = 1;
+
+    pthread_mutex_lock(&playing->lock);
+    g = find_game_named(playing, gameName, hash);
+    if (g == NULL) {
+        pthread_mutex_unlock(&playing->lock);
+        close(fd);
+        return;
+    }
+    sp = pool_alloc(&p->server->spectatorPool);
+    sp->fd = fd;
+    sp->game = g;
+    pthread_mutex_lock(&g->worker->lock);
+    sp->nextSpectator = g->worker->pendingSpectators;
+    g->worker->pendingSpectators = sp;
+    pthread_mutex_unlock(&g->worker->lock);
+    pthread_mutex_unlock(&playing->lock);
 
-    sort->fdA = fd[0];
-    sort->fdB = fd[1];
-    sort->fdC = fd[2];
-    sort->fdD = fd[3];
-}	
+    if (write(g->worker->wakeFd, &wake, sizeof(wake)) < 0) {
+        perror("Error waking worker");
+    }
+}
 
-/* Sort by player name such that playerA is the lowest value when all values
- * are compared with strcmp. PlayerB is teh next lowest and so on.
- * Also makes sure to move all the other data associated with each player 
+/* Reads as much of a player's handshake (their name, then the name of the
+ * game they want, after BINARY_HELLO if they want the binary protocol) as 
+ * has arrived. Once both are read the player is added to their game, which
+ * is handed to a worker if they filled it. A spectator sends SPECTATE_HELLO
+ * in place of their name, and is handed to the worker playing their game.
+ * Players who leave, or send an empty or too long name, are dropped.
+ * @params listener The listener that accepted the player
+ * @params h The player's handshake
  */
-void sort_players(struct Game *sort) {
-    char *nameTemp, *names[4];
-    FILE *fromTemp, *from[4];
-    FILE *toTemp, *to[4];
-    int fdTemp, fd[4], playersToSort, unSorted = 0;
-
-    names[0] = sort->playerAName;
-    names[1] = sort->playerBName;
-    names[2] = sort->playerCName;
-    names[3] = sort->playerDName;
-
-    from[0] = sort->fromA;
-    from[1] = sort->fromB;
-    from[2] = sort->fromC;
-    from[3] = sort->fromD;
-
-    to[0] = sort->toA;
-    to[1] = sort->toB;
-    to[2] = sort->toC;
-    to[3] = sort->toD;
-
-    fd[0] = sort->fdA;
-    fd[1] = sort->fdB;
-    fd[2] = sort->fdC;
-    fd[3] = sort->fdD;
-
-    playersToSort = (get_player_no(sort) - 1); 
-  
-    do {
-        unSorted = 0;
-        for (int i = 0; i < playersToSort; ++i) {
-            if (strcmp(names[i], names[i + 1]) > 0) {
-                nameTemp = names[i];
-                names[i] = names[i + 1];
-                names[i + 1] = nameTemp;
-                fromTemp = from[i];
-                from[i] = from[i + 1];
-                from[i + 1] = fromTemp;
-                toTemp = to[i];
-                to[i] = to[i + 1];
-                to[i + 1] = toTemp;
-                fdTemp = fd[i];
-                fd[i] = fd[i + 1];
-                fd[i + 1] = fdTemp;
-                unSorted = 1;
-            }
+void read_handshake(struct Listener *listener, struct Handshake *h) {
+    char *line, gameName[NAME_LENGTH + 1];
+    struct Game *fullGame;
+    int status, fd;
+
+    while ((status = read_line(&h->reader, &line)) != LINE_WAIT) {
+        if (status != LINE_READY || line[0] == 0) {
+            end_handshake(listener, h, 1);
+            return;
         }
-    } while (unSorted);
-	
-    put_sorted_players_back(sort, names, from, to, fd);
-}
-
-/* Add a new player to the next player that has not yet been added in a game
- */
-void add_new_player(struct Game *gameWait, FILE *fromPlayer, FILE *toPlayer, 
-        int fd, char* playerName) {
-    if (gameWait->playerAName == NULL) {
-        gameWait->playerAName = playerName;
-        gameWait->fromA = fromPlayer;
-        gameWait->toA = toPlayer;
-        gameWait->fdA = fd;
-    } else if (gameWait->playerBName == NULL) {
-        gameWait->playerBName = playerName;
-        gameWait->fromB = fromPlayer;
-        gameWait->toB = toPlayer;
-        gameWait->fdB = fd;
-        if (gameWait->players == 2) {
-            gameWait->gameReady = 1;
-        }
-    } else if (gameWait->playerCName == NULL) {
-        gameWait->playerCName = playerName;
-        gameWait->fromC = fromPlayer;
-        gameWait->toC = toPlayer;
-        gameWait->fdC = fd;
-        if (gameWait->players == 3) {
-            gameWait->gameReady = 1;
+        if (!h->haveName && !h->binary && !strcmp(line, BINARY_HELLO)) {
+            h->binary = 1;
+            continue;
         }
-    } else {
-        gameWait->playerDName = playerName;
-        gameWait->fromD = fromPlayer;
-        gameWait->toD = toPlayer;
-        gameWait->fdD = fd;
-        gameWait->gameReady = 1;
+        if (!h->haveName && !strcmp(line, SPECTATE_HELLO)) {
+            h->spectator = 1;
+            h->haveName = 1;
+            continue;
+        }
+        if (!h->haveName) {
+            strcpy(h->name, line);
+            h->haveName = 1;
+            continue;
+        }
+        if (h->spectator) {
+            // Names are never interned for spectators
+            fd = h->fd;
+            strcpy(gameName, line);
+            end_handshake(listener, h, 0);
+            watch_game(listener->port, gameName, fd);
+            return;
+        }
+        fullGame = add_to_game(listener, h, line);
+        end_handshake(listener, h, 0);
+        if (fullGame != NULL) {
+            fullGame->deckIndex = 0;
+            start_game(listener->port->server, fullGame);
+        }
+        return;
     }
-    sort_players(gameWait);
 }
 
-/* Gets information from player and then adds that player to the supplied game
- * If a game is full then a new game is created.
+/* Stops waiting on a listener's socket for ACCEPT_BACKOFF ms. The socket
+ * is level triggered, so while accept fails it would otherwise wake the
+ * listener's thread straight away and hold up its handshakes.
+ * @params listener The listener that could not accept
  */
-void add_to_game(struct Game *headGame, int fd) {
-    FILE *fromPlayer, *toPlayer;
-    char *gameName, *playerName;
-    struct Game *currentGame, *newGame;
-
-    fromPlayer = fdopen(fd, "r");
-    toPlayer = fdopen(fd, "w");
+void pause_accepting(struct Listener *listener) {
+    if (listener->pausedUntil == 0 && epoll_ctl(listener->epollFd, 
+            EPOLL_CTL_DEL, listener->fd, NULL) == 0) {
+        listener->pausedUntil = now_nanos() + 
+                (uint64_t)ACCEPT_BACKOFF * 1000000;
+    }
+}
 
-    playerName = get_message(fromPlayer); ///Return NULL, close connection
-    gameName = get_message(fromPlayer); /// Return NULL, close connection
+/* Puts a paused listener's socket back in its epoll set once its back-off
+ * has passed
+ * @params listener The listener to check
+ * @params timeout How long the listener would otherwise wait in ms, or -1
+ * @return how long to wait (as for epoll_wait) so as to wake by the end of
+ *      the back-off, if it is still going
+ */
+int resume_accepting(struct Listener *listener, int timeout) {
+    struct epoll_event event;
+    uint64_t now;
+    int left;
+
+    if (listener->pausedUntil == 0) {
+        return timeout;
+    }
+    now = now_nanos();
+    if (listener->pausedUntil > now) {
+        left = (listener->pausedUntil - now + 999999) / 1000000;
+        return (timeout < 0 || left < timeout) ? left : timeout;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(listener->epollFd, EPOLL_CTL_ADD, listener->fd, 
+            &event) < 0) {
+        exit_server(listener->port->server, BAD_SYSTEM);
+    }
+    listener->pausedUntil = 0;
+    return timeout;
+}
 
-    currentGame = headGame;
+/* Accepts the pending connections on a (non-blocking) listening socket 
+ * that epoll has reported readable, up to ACCEPT_BATCH so a burst of 
+ * connections is drained in one go without holding up the handshakes 
+ * already started, and starts waiting for each new player's handshake. 
+ * Peer addresses are never looked up. Accepted sockets are non-blocking and
+ * close-on-exec.
+ * @params listener The listener to accept on
+ */
+void accept_players(struct Listener *listener) {
+    struct Server *s = listener->port->server;
+    struct epoll_event event;
+    struct Handshake *h;
+    uint64_t acceptedAt = now_nanos();
+    int fd, accepted;
+
+    for (accepted = 0; accepted < ACCEPT_BATCH; ++accepted) {
+        fd = accept4(listener->fd, NULL, NULL, 
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // Most likely out of file descriptors, give games time to
+                // end without waking for the listening socket meanwhile
+                perror("Error accepting connection");
+                pause_accepting(listener);
+            }
+            return;
+        }
 
-    if (headGame->gameName == NULL) {
-        headGame->gameName = gameName;
-        add_new_player(currentGame, fromPlayer, toPlayer, fd, playerName);
-        if (gameName[0] == '2') {
-            headGame->players = 2;
-        } else if (gameName[0] == '3') {
-            headGame->players = 3;
+        h = pool_alloc(&s->handshakePool);
+        h->fd = fd;
+        h->binary = 0;
+        h->spectator = 0;
+        h->haveName = 0;
+        h->acceptedAt = acceptedAt;
+        init_line_reader(&h->reader, fd, NAME_LENGTH);
+        h->newer = NULL;
+        h->older = listener->newest;
+        if (listener->newest != NULL) {
+            listener->newest->newer = h;
         } else {
-            headGame->players = 4;
+            listener->oldest = h;
         }
-        return;
-    }
+        listener->newest = h;
 
-    while (currentGame != NULL) {
-        if (!(strcmp(currentGame->gameName, gameName))) {
-            add_new_player(currentGame, fromPlayer, toPlayer, fd, playerName);
-            return;
+        event.events = EPOLLIN;
+        event.data.ptr = h;
+        if (epoll_ctl(listener->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            end_handshake(listener, h, 1);
         }
-        if (currentGame->nextGame == NULL) {
-            break; 
-        }
-        currentGame = currentGame->nextGame;
     }
+}
 
-    newGame = create_game(gameName);
-    currentGame->nextGame = newGame;
-    if (gameName[0] == '1') {
-        newGame->players = 1;
-    } else if (gameName[0] == '2') {
-        newGame->players = 2;
-    } else {
-        newGame->players = 4;
+/* Drops the players whose handshakes have not finished by their deadline
+ * @return how long until the next deadline in milliseconds (rounded up), or
+ *      -1 if there are no handshakes left
+ */
+int expire_handshakes(struct Listener *listener) {
+    struct Server *s = listener->port->server;
+    uint64_t now = now_nanos(), deadline;
+
+    while (listener->oldest != NULL) {
+        deadline = listener->oldest->acceptedAt + s->handshakeTimeout;
+        if (deadline > now) {
+            return (deadline - now + 999999) / 1000000;
+        }
+        end_handshake(listener, listener->oldest, 1);
+        __atomic_store_n(&listener->timedOut, listener->timedOut + 1, 
+                __ATOMIC_RELAXED);
     }
-    add_new_player(newGame, fromPlayer, toPlayer, fd, playerName);
-
+    return -1;
 }
-    
 
-/* Wait for connections from players on a port, adds them to games indicated,
- * then  starts new games with a new thread.
+/* Waits for connections from players on one of a port's listeners and for
+ * the handshakes of the players it has accepted, adding them to the games
+ * they ask for, then hands full games to a reactor worker to be played. A
+ * player who is slow to send their names only holds up themselves.
  @return doesn't return, but a void pointer is indicated
  */
 void* connection_wait(void* arg) {
-    struct Port *currentPort = (struct Port*)arg;
+    struct Listener *listener = (struct Listener*)arg;
+    struct Server *s = listener->port->server;
+    struct epoll_event events[MAX_EVENTS], event;
+    int eventCount, i, timeout = -1;
 
-    int fd;
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrSize;
-    int error, fdServer = currentPort->fd;
-    char hostname[MAXHOSTNAMELEN];//WHATS GOING ON HERE
-    pthread_t threadId;
-    struct Game *headGame, *currentGame;
-
-    headGame = create_game(NULL);
-    currentPort->headGame = headGame;
+    listener->oldest = listener->newest = NULL;
+    listener->pausedUntil = 0;
+    listener->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (listener->epollFd < 0 || epoll_ctl(listener->epollFd, 
+            EPOLL_CTL_ADD, listener->fd, &event) < 0) {
+        exit_server(s, BAD_SYSTEM);
+    }
 
     while(1) {
-        fromAddrSize = sizeof(struct sockaddr_in);
-        // Block, waiting for new connection. (fromAddr structure will be 
-        // populated with details of client address
-        fd = accept(fdServer, (struct sockaddr*)&fromAddr, &fromAddrSize);
-        if(fd < 0) {
-            perror("Error accepting connection");
-            exit(1);
-        }
-     
-        // Convert IP address to hostname
-        error = getnameinfo((struct sockaddr*)&fromAddr, fromAddrSize, 
-                hostname, MAXHOSTNAMELEN, NULL, 0, 0);
-        if(error) {
-            fprintf(stderr, "Error getting hostname: %s\n", 
-                    gai_strerror(error));
-        } else {
-            add_to_game(headGame, fd);
-        }
-        
-        currentGame = headGame; 
-
-        while (currentGame != NULL) {
-            if (currentGame->gameReady) {
-                currentGame->currentDeck = currentPort->firstDeck;
-                pthread_create(&threadId, NULL, new_game, (void*)currentGame);
-                pthread_detach(threadId);
+        eventCount = epoll_wait(listener->epollFd, events, MAX_EVENTS, 
+                timeout);
+        for (i = 0; i < eventCount; ++i) {
+            if (events[i].data.ptr == NULL) {
+                accept_players(listener);
+            } else {
+                read_handshake(listener, 
+                        (struct Handshake*)events[i].data.ptr);
             }
-            currentGame = currentGame->nextGame;
         }
+        timeout = resume_accepting(listener, expire_handshakes(listener));
     }
     return NULL;
 }
@@ -1517,381 +2974,944 @@ void check_for_duplicate_port(struct Server *s, int port, struct Port *head) {
     }
 }
 
-/* Opens a port as supplied by the admin and returns a file descriptor for that port
- * @returns file descripter for port supplied
+/* Open a socket, bind to it and listen for connections
+ * @params port The port to listen on
+ * @params shared Whether other sockets can listen on the port too (with 
+ *      SO_REUSEPORT), for a port with more than one shard
+ * @return returns a file descriptor for the socket, or -1 if the port can't
+ *      be listened on
  */
-int open_admin_listen(int port, FILE *toAdmin) {
-    int fd; ///MAYBE CHANGE THIS
+int listen_on_port(int port, int shared) {
+    int fd;
     struct sockaddr_in serverAddr;
     int optVal;
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if(fd < 0) {
-        fprintf(toAdmin, "Unable to listen on port\n");
-        return 0;
+        return -1;
     }
 
     optVal = 1;
-    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0) {
-        fprintf(toAdmin, "Unable to listen on port\n");
-        return 0;
-    }
-
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_port = htons(port);
     serverAddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if(bind(fd, (struct sockaddr*)&serverAddr, 
-            sizeof(struct sockaddr_in)) < 0) {
-        fprintf(toAdmin, "Unable to listen on port\n");
-        return 0;
-    }
-
-    if(listen(fd, SOMAXCONN) < 0) {
-        fprintf(toAdmin, "Unable to listen on port\n");
-        return 0;
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(int)) < 0 ||
+            (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optVal, 
+            sizeof(int)) < 0) || bind(fd, (struct sockaddr*)&serverAddr, 
+            sizeof(struct sockaddr_in)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
     }
 
     return fd;
 }
 
-/* Open a new port to listen for games (on the end of Port Struct linked list)
- * as supplied by the admin.
+/* Open the admin port, exiting if it can't be listened on
+ * @return returns a file descriptor for the admin port
  */
-void open_new_port(struct Server *s, int port, char* deckfile, FILE *toAdmin) {
-    struct Port *headPort = s->headPort, *currentPort, *newPort;
-    int deckError;
-    pthread_t threadId;
-
-    currentPort = headPort;
+int open_listen(struct Server *s, int port) {
+    int fd = listen_on_port(port, 0);
 
-    while (currentPort->nextPort != NULL) {
-        if (currentPort->port == port || s->adminPort == port) {
-            fprintf(toAdmin, "Invalid port number\n");
-            return;
-        }
-        currentPort = currentPort->nextPort;
-    } // After this current port will be last port
-    
-    newPort = malloc(sizeof(*newPort));
-    currentPort->nextPort = newPort;
-    newPort->nextPort = NULL;
-    newPort->port = port;
-    newPort->deckfile = malloc(sizeof(strlen(deckfile) + 1));
-    strncpy(newPort->deckfile, deckfile, (strlen(deckfile) + 1));
-
-    deckError = load_deckfile(s, newPort);
-    if (deckError == DECKFILE_FAIL) {
-        fprintf(toAdmin, "Unable to access deckfile\n");
-        currentPort->nextPort = NULL;
-        free(newPort);
-        return;
-    } else if (deckError == DECK_FAIL) {
-        fprintf(toAdmin, "Error reading deck\n");
-        currentPort->nextPort = NULL;
-        free(newPort);
-        return;
+    if (fd < 0) {
+        exit_server(s, LISTEN_FAIL);
     }
+    return fd;
+}
 
-    newPort->fd = open_admin_listen(port, toAdmin);
+/* Opens a listening socket on a port for each of its shards
+ * @return 0 if they were all opened, otherwise LISTEN_FAIL (and none are 
+ *      left open)
+ */
+int open_listeners(struct Port *p) {
+    int i;
 
-    if (newPort->fd == 0) {
-        currentPort->nextPort = NULL;
-        free(newPort);
-        return;
+    for (i = 0; i < p->shards; ++i) {
+        p->listeners[i].fd = listen_on_port(p->port, p->shards > 1);
+        if (p->listeners[i].fd < 0) {
+            while (i-- > 0) {
+                close(p->listeners[i].fd);
+                p->listeners[i].fd = -1;
+            }
+            return LISTEN_FAIL;
+        }
     }
-    
-    pthread_create(&threadId, NULL, connection_wait, (void*)newPort);
-    pthread_detach(threadId);
-    fprintf(toAdmin, "OK\n");
-    return;
+    return 0;
 }
 
-/* Create a new Player struct and indiatlise it to NULL/0 values
- * @return return a Player Struct
+/* Starts a thread accepting connections on each of a port's listeners
  */
-struct Players* create_player(void) {
-    struct Players *newPlayer;
+void start_listeners(struct Port *p) {
+    pthread_t threadId;
+    int i;
 
-    newPlayer = malloc(sizeof(*newPlayer));
+    for (i = 0; i < p->shards; ++i) {
+        pthread_create(&threadId, NULL, connection_wait, &p->listeners[i]);
+        pthread_detach(threadId);
+    }
+}
 
-    newPlayer->nextPlayer = NULL;
-    newPlayer->name = NULL;
-    newPlayer->gamesPlayed = 0;
-    newPlayer->roundsWon = 0;
-    newPlayer->gamesWon = 0;
+/* Frees a port that failed to open
+ */
+void free_port(struct Port *p) {
+    int i;
 
-    return newPlayer;
+    free_decks(&p->decks);
+    for (i = 0; i < p->shards; ++i) {
+        pthread_mutex_destroy(&p->lobbies[i].lock);
+        free(p->lobbies[i].buckets);
+        pthread_mutex_destroy(&p->playing[i].lock);
+        free(p->playing[i].buckets);
+    }
+    free(p->lobbies);
+    free(p->playing);
+    free(p->listeners);
+    free(p->deckfile);
+    free(p);
 }
 
-/* Checks if the supplied player name already exits in list of players
- * @return 1 if it does exit, 0 otherwise
+/* Loads the deckfile of a port opened by the admin and listens on it. Only
+ * once both are done is the port linked on to the end of the Port struct 
+ * linked list and its connections accepted.
+ * @return 0 if the port is open or the appropriate error code if not
  */
-int check_if_new_player(struct Players *headPlayer, char *name) {
-    struct Players *currentPlayer;
+int open_port(struct Server *s, struct Port *newPort) {
+    struct Port *currentPort;
+    int deckError;
 
-    currentPlayer = headPlayer;
+    if ((deckError = load_deckfile(newPort->deckfile, &newPort->decks))) {
+        return deckError;
+    }
 
-    if (name == NULL) {
-        return 0;
+    if (open_listeners(newPort)) {
+        return LISTEN_FAIL;
     }
 
-    while (currentPlayer != NULL) {
-        if (!strcmp(currentPlayer->name, name)) {
-            return 0;
-        }
-        currentPlayer = currentPlayer->nextPlayer;
+    /* Only link the port in once it is fully set up */
+    pthread_mutex_lock(&s->portLock);
+    currentPort = s->headPort;
+    while (currentPort->nextPort != NULL) {
+        currentPort = currentPort->nextPort;
     }
-    return 1;
+    __atomic_store_n(&currentPort->nextPort, newPort, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s->portLock);
+    
+    start_listeners(newPort);
+    return 0;
 }
 
-/* Add game stats for a new player to list of players
+/* Thread for a port loader: opens the ports queued by the admin one at a 
+ * time, so loading a large deckfile never holds up the admin.
  */
-void add_new_player_stats(struct Server *s, char *name, int points, 
-        int winner) {
-    struct Players *newPlayer, *headPlayer, *previousPlayer;
+void* port_loader(void *arg) {
+    struct Server *s = (struct Server*)arg;
+    struct PortJob *job;
+    int result;
 
-    headPlayer = s->headPlayer;
-    previousPlayer = headPlayer;
+    while (1) {
+        pthread_mutex_lock(&s->jobLock);
+        while (s->queueHead == NULL) {
+            pthread_cond_wait(&s->jobQueued, &s->jobLock);
+        }
+        job = s->queueHead;
+        s->queueHead = job->nextQueued;
+        if (s->queueHead == NULL) {
+            s->queueTail = NULL;
+        }
+        pthread_mutex_unlock(&s->jobLock);
 
-    while (previousPlayer->nextPlayer != NULL) {
-        previousPlayer = previousPlayer->nextPlayer;
+        __atomic_store_n(&job->state, JOB_LOADING, __ATOMIC_RELAXED);
+        result = open_port(s, job->port);
+        if (result) {
+            free_port(job->port);
+        }
+        job->port = NULL;
+        __atomic_store_n(&job->result, result, __ATOMIC_RELAXED);
+        __atomic_store_n(&job->state, JOB_DONE, __ATOMIC_RELEASE);
     }
+    return NULL;
+}
 
-    newPlayer = create_player();
-    newPlayer->name = name;
-    newPlayer->gamesPlayed = 1;
-    newPlayer->roundsWon = points;
-    newPlayer->gamesWon = winner;
-    previousPlayer->nextPlayer = newPlayer;
+/* Starts the port loader threads
+ */
+void start_port_loaders(struct Server *s) {
+    pthread_t threadId;
+    int i;
+
+    for (i = 0; i < PORT_LOADERS; ++i) {
+        pthread_create(&threadId, NULL, port_loader, (void*)s);
+        pthread_detach(threadId);
+    }
 }
 
-/* Update the statistics with new information for the player supplied
+/* Checks to see if a port is in use by the server or is being opened by a 
+ * job. Jobs are checked first: a job links its port in before it is done.
+ * @return 1 if it is, 0 if not
  */
-void update_stats(struct Players *p, int points, int winner) {
-    p->roundsWon = (p->roundsWon) + points;
-    p->gamesWon = (p->gamesWon) + winner;
-    p->gamesPlayed = (p->gamesPlayed) + 1;
+int port_in_use(struct Server *s, int port) {
+    struct Port *currentPort;
+    struct PortJob *job;
+
+    if (port == s->adminPort) {
+        return 1;
+    }
+    for (job = s->jobs; job != NULL; job = job->next) {
+        if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOB_DONE &&
+                job->portNumber == port) {
+            return 1;
+        }
+    }
+    for (currentPort = s->headPort; currentPort != NULL; 
+            currentPort = __atomic_load_n(&currentPort->nextPort, 
+            __ATOMIC_ACQUIRE)) {
+        if (currentPort->port == port) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-/* Adds a new player or updates an existing player game statistics
+/* Frees the finished jobs older than the newest KEPT_JOBS finished jobs, 
+ * so the admin opening ports cannot grow the list of jobs forever. Jobs
+ * still queued or loading are kept, as a port loader has them.
  */
-void add_player_stats(struct Game *g, struct Server *s) {
-    struct Players *headPlayer, *currentPlayer;
-    int skipA = 0;
+void prune_jobs(struct Server *s) {
+    struct PortJob **link = &s->jobs, *job;
+    int finished = 0;
+
+    while ((job = *link) != NULL) {
+        if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != JOB_DONE ||
+                ++finished <= KEPT_JOBS) {
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        free(job);
+    }
+}
 
-    headPlayer = s->headPlayer;
-    currentPlayer = headPlayer;
+/* Queues a port supplied by the admin to be opened in the background, and 
+ * replies with the id of the job opening it (see print_jobs).
+ */
+void open_new_port(struct Server *s, int port, char* deckfile, FILE *toAdmin) {
+    struct PortJob *job;
 
-    if (headPlayer->nextPlayer == NULL) {
-        headPlayer->name = g->playerAName;
-        headPlayer->roundsWon = g->pointsA;
-        headPlayer->gamesWon = g->winnerA;
-        headPlayer->gamesPlayed = 1;
-        skipA = 1;
+    if (port < 1 || port > 65535 || port_in_use(s, port)) {
+        fprintf(toAdmin, "Invalid port number\n");
+        return;
+    }
+    
+    job = calloc(1, sizeof(*job));
+    job->id = ++s->nextJobId;
+    job->state = JOB_QUEUED;
+    job->portNumber = port;
+    job->port = create_port(s, port, deckfile);
+    job->next = s->jobs;
+    s->jobs = job;
+    prune_jobs(s);
+
+    pthread_mutex_lock(&s->jobLock);
+    if (s->queueTail) {
+        s->queueTail->nextQueued = job;
+    } else {
+        s->queueHead = job;
     }
+    s->queueTail = job;
+    pthread_cond_signal(&s->jobQueued);
+    pthread_mutex_unlock(&s->jobLock);
 
-    while (currentPlayer != NULL) {
-        if ((!strcmp(g->playerAName, currentPlayer->name)) && !skipA) {
-            update_stats(currentPlayer, g->pointsA, g->winnerA);
-        } else {
-            skipA = 0;
+    fprintf(toAdmin, "Job %d\n", job->id);
+}
+
+/* Finds the first player (in name order) whose name comes after the 
+ * supplied name, or is the supplied name if inclusive is set.
+ * @return the player found or NULL if there are none after the name
+ */
+struct Players* seek_player(struct Stats *st, char *name, int inclusive) {
+    struct Players *current = st->headPlayer, *next;
+    int i, compare;
+
+    for (i = SKIP_LEVELS - 1; i >= 0; --i) {
+        while ((next = next_player(current, i)) != NULL) {
+            compare = strcmp(next->name->text, name);
+            if (compare > 0 || (inclusive && compare == 0)) {
+                break;
+            }
+            current = next;
         }
-        if (!(strcmp(g->playerBName, currentPlayer->name))) {
-            update_stats(currentPlayer, g->pointsB, g->winnerB);
+    }
+    return next_player(current, 0);
+}
+
+/* Copies the statistics of the players from the first whose name comes 
+ * after start (or is start if inclusive is set), in name order, while 
+ * their names begin with prefix
+ * @params rows The copies, grown (from *capacity rows) as needed
+ * @params limit The most players to copy, or -1 for all of them
+ * @return the number of players copied
+ */
+int copy_players(struct Stats *st, char *start, int inclusive, char *prefix,
+        int limit, struct PlayerRow **rows, int *capacity) {
+    struct Players *p = seek_player(st, start, inclusive);
+    int prefixLength = strlen(prefix), count = 0;
+
+    for (; p != NULL && count != limit && 
+            !strncmp(p->name->text, prefix, prefixLength); 
+            p = next_player(p, 0)) {
+        if (count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : EXPORT_BATCH;
+            *rows = realloc(*rows, *capacity * sizeof(struct PlayerRow));
         }
-        
-        if (g->playerCName != NULL && !(strcmp(g->playerCName, 
-                currentPlayer->name))) {
-            update_stats(currentPlayer, g->pointsC, g->winnerC);
+        (*rows)[count].name = p->name;
+        (*rows)[count].gamesPlayed = __atomic_load_n(&p->gamesPlayed, 
+                __ATOMIC_RELAXED);
+        (*rows)[count].roundsWon = __atomic_load_n(&p->roundsWon, 
+                __ATOMIC_RELAXED);
+        (*rows)[count].gamesWon = __atomic_load_n(&p->gamesWon, 
+                __ATOMIC_RELAXED);
+        count++;
+    }
+    return count;
+}
+
+/* Copies players' statistics as copy_players does, as they were between 
+ * two games' results being published, so no game is ever seen in part. 
+ * The copy is made without locks and tried again if a game was published 
+ * meanwhile. After SNAPSHOT_TRIES it is made holding the publish lock, so
+ * games ending constantly can't hold the admin up forever.
+ * @return the number of players copied
+ */
+int snapshot_players(struct Stats *st, char *start, int inclusive, 
+        char *prefix, int limit, struct PlayerRow **rows, int *capacity) {
+    unsigned int version;
+    int count, tries;
+
+    for (tries = 0; tries < SNAPSHOT_TRIES; ++tries) {
+        version = __atomic_load_n(&st->version, __ATOMIC_ACQUIRE);
+        if (version & 1) {
+            continue;
         }
-        if (g->playerDName != NULL && !(strcmp(g->playerDName, 
-                currentPlayer->name))) {
-            update_stats(currentPlayer, g->pointsD, g->winnerD);
+        count = copy_players(st, start, inclusive, prefix, limit, rows, 
+                capacity);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (version == __atomic_load_n(&st->version, __ATOMIC_RELAXED)) {
+            return count;
         }
-        currentPlayer = currentPlayer->nextPlayer;
     }
 
-    if (check_if_new_player(headPlayer, g->playerAName)) {
-        add_new_player_stats(s, g->playerAName, g->pointsA, g->winnerA);
+    pthread_mutex_lock(&st->publishLock);
+    count = copy_players(st, start, inclusive, prefix, limit, rows, 
+            capacity);
+    pthread_mutex_unlock(&st->publishLock);
+    return count;
+}
+
+/* Prints one player's statistics as a "name,played,rounds,won" line
+ */
+void print_row(struct PlayerRow *row, FILE *toAdmin) {
+    fprintf(toAdmin, "%s,%d,%d,%d\n", row->name->text, row->gamesPlayed, 
+            row->roundsWon, row->gamesWon);
+}
+
+/* Prints the game statistics for each player in name order, from a 
+ * snapshot of them. Games ending are never held up by it unless they
+ * keep changing the statistics while it is taken.
+ */
+void print_statistics(struct Stats *st, FILE *toAdmin) {
+    struct PlayerRow *rows = NULL;
+    int capacity = 0, count, i;
+
+    count = snapshot_players(st, "", 1, "", -1, &rows, &capacity);
+    for (i = 0; i < count; ++i) {
+        print_row(&rows[i], toAdmin);
+    }
+    free(rows);
+    fprintf(toAdmin, "OK\n");
+}
+
+/* Prints one page of the game statistics: at most limit players in name 
+ * order, optionally only those whose names begin with prefix and only those
+ * after the player named by after (the cursor from the previous page).
+ * The page ends with "MORE <last name>" if there are more players to come,
+ * or "OK" otherwise.
+ * @params st The player statistics
+ * @params toAdmin The stream to the admin
+ * @params limit The most players to print
+ * @params prefix The prefix all names printed must have or NULL for all
+ * @params after The last player of the previous page or NULL for the first
+ */
+void print_statistics_page(struct Stats *st, FILE *toAdmin, int limit, 
+        char *prefix, char *after) {
+    struct PlayerRow *rows = NULL;
+    int capacity = 0, count, copy, i;
+
+    if (prefix == NULL) {
+        prefix = "";
+    }
+
+    // One more than the page is copied, to tell whether there are more
+    copy = (limit == INT_MAX) ? -1 : limit + 1;
+    if (after != NULL && strcmp(after, prefix) >= 0) {
+        count = snapshot_players(st, after, 0, prefix, copy, &rows, 
+                &capacity);
+    } else {
+        count = snapshot_players(st, prefix, 1, prefix, copy, &rows, 
+                &capacity);
     }
-    if (check_if_new_player(headPlayer, g->playerBName)) {
-        add_new_player_stats(s, g->playerBName, g->pointsB, g->winnerB);
+
+    for (i = 0; i < count && i < limit; ++i) {
+        print_row(&rows[i], toAdmin);
     }
-    if (check_if_new_player(headPlayer, g->playerCName)) {
-        add_new_player_stats(s, g->playerCName, g->pointsC, g->winnerC);
+    if (count > limit) {
+        fprintf(toAdmin, "MORE %s\n", rows[limit - 1].name->text);
+    } else {
+        fprintf(toAdmin, "OK\n");
     }
-    if (check_if_new_player(headPlayer, g->playerDName)) {
-        add_new_player_stats(s, g->playerDName, g->pointsD, g->winnerD);
+    free(rows);
+}
+
+/* Gathers the next EXPORT_BATCH players of the session's export and 
+ * describes them as buffers for writev. Player names are not copied 
+ * (players are never removed, so the names stay valid).
+ * In CSV mode each player is a "name,played,rounds,won" line. In binary mode
+ * each is a 2 byte name length, 3 4 byte counts (played, rounds, won), then
+ * the name, all in network byte order.
+ * @params st The player statistics
+ * @params a The exporting admin session
+ * @params iov Where to describe the buffers (EXPORT_BATCH * 2 of them)
+ * @params counts Space to format the counts of each player into
+ * @return The number of buffers, 0 if there are no more players
+ */
+int gather_export(struct AdminSession *a, struct iovec *iov, 
+        char counts[][40]) {
+    struct PlayerRow *row;
+    uint16_t nameLength;
+    uint32_t values[3];
+    int gathered, binary = (a->exporting == 'B');
+
+    for (gathered = 0; gathered < EXPORT_BATCH && 
+            a->exportNext < a->exportCount; ++gathered) {
+        row = &a->exportRows[a->exportNext++];
+        if (binary) {
+            nameLength = htons(row->name->length);
+            values[0] = htonl(row->gamesPlayed);
+            values[1] = htonl(row->roundsWon);
+            values[2] = htonl(row->gamesWon);
+            memcpy(counts[gathered], &nameLength, 2);
+            memcpy(counts[gathered] + 2, values, 12);
+            iov[gathered * 2].iov_base = counts[gathered];
+            iov[gathered * 2].iov_len = 14;
+            iov[gathered * 2 + 1].iov_base = row->name->text;
+            iov[gathered * 2 + 1].iov_len = row->name->length;
+        } else {
+            iov[gathered * 2].iov_base = row->name->text;
+            iov[gathered * 2].iov_len = row->name->length;
+            iov[gathered * 2 + 1].iov_base = counts[gathered];
+            iov[gathered * 2 + 1].iov_len = sprintf(counts[gathered], 
+                    ",%d,%d,%d\n", row->gamesPlayed, row->roundsWon, 
+                    row->gamesWon);
+        }
     }
-}   
+    return gathered * 2;
+}
 
-/* Checks if the supplied name is the lowest name (with strcmp) out of those 
- * that have not been printed yet
- * @return 0 if it is not lowest, 1 if is lowest
+/* Prints the state of a port opening job (or of all of them, newest first,
+ * if id is 0) as id,port,state where the state is queued, loading, OK or 
+ * the error opening the port. Jobs that finished long ago (see prune_jobs)
+ * are unknown.
  */
-int check_if_first_name(struct Players *headPlayer, 
-        struct Players *checkPlayer, char **printedPlayers, int playerNo) {
-    char *nameCheck = checkPlayer->name;
-    int firstName = 0;
+void print_jobs(struct Server *s, int id, FILE *toAdmin) {
+    static char *errors[] = {
+        [DECKFILE_FAIL] = "Unable to access deckfile",
+        [DECK_FAIL] = "Error reading deck",
+        [LISTEN_FAIL] = "Unable to listen on port",
+    };
+    struct PortJob *job;
+    int found = 0;
+
+    for (job = s->jobs; job != NULL; job = job->next) {
+        if (id && job->id != id) {
+            continue;
+        }
+        found = 1;
+        fprintf(toAdmin, "%d,%d,", job->id, job->portNumber);
+        switch (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE)) {
+            case JOB_QUEUED:
+                fprintf(toAdmin, "queued\n");
+                break;
+            case JOB_LOADING:
+                fprintf(toAdmin, "loading\n");
+                break;
+            default:
+                fprintf(toAdmin, "%s\n", job->result ? 
+                        errors[job->result] : "OK");
+        }
+    }
+    fprintf(toAdmin, (id && !found) ? "Unknown job\n" : "OK\n");
+}
 
-    struct Players *currentPlayer = headPlayer;
+/* Prints the number of games waiting for players in the lobby of each port
+ */
+void print_lobbies(struct Server *s, FILE *toAdmin) {
+    struct Port *currentPort;
+    int i, waiting;
 
-    for (int j = 0; j < playerNo; j++) {
-        if (printedPlayers[j] != NULL && 
-                (!strcmp(printedPlayers[j], nameCheck))) {
-            return 0;
+    for (currentPort = s->headPort; currentPort != NULL; 
+            currentPort = __atomic_load_n(&currentPort->nextPort, 
+            __ATOMIC_ACQUIRE)) {
+        if (currentPort->port == 0) {
+            continue;
+        }
+        for (i = 0, waiting = 0; i < currentPort->shards; ++i) {
+            waiting += __atomic_load_n(&currentPort->lobbies[i].size, 
+                    __ATOMIC_RELAXED);
         }
+        fprintf(toAdmin, "%d,%d\n", currentPort->port, waiting);
     }
-    
+    fprintf(toAdmin, "OK\n");
+}
 
-    while (currentPlayer != NULL) {
-        if (strcmp(nameCheck, currentPlayer->name) > 0) {
-            firstName = 0; 
-        } else {
-            firstName = 1;
+/* Prints the histograms of the game workers and the port listeners (see 
+ * histogram.h): the times in nanoseconds players wait to be seated and take
+ * to move, the time moves take to play and the messages and bytes each 
+ * game sends. The listeners of ports still being opened are skipped.
+ */
+void print_histograms(struct Server *s, FILE *toAdmin) {
+    struct Histogram *totals = calloc(5, sizeof(struct Histogram));
+    struct Port *currentPort;
+    struct Worker *w;
+    int i;
+
+    for (i = 0; i < s->workerCount; ++i) {
+        w = &s->workers[i];
+        histogram_add(&totals[1], &w->moveWaits);
+        histogram_add(&totals[2], &w->moveTimes);
+        histogram_add(&totals[3], &w->gameMessages);
+        histogram_add(&totals[4], &w->gameBytes);
+    }
+    for (currentPort = s->headPort; currentPort != NULL; 
+            currentPort = __atomic_load_n(&currentPort->nextPort, 
+            __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < currentPort->shards; ++i) {
+            histogram_add(&totals[0], &currentPort->listeners[i].seatTimes);
         }
-        for (int i = 0; i < playerNo; i++) {
-            if (printedPlayers[i] != NULL && 
-                    (!strcmp(printedPlayers[i], currentPlayer->name))) {
-                firstName = 1;
-            }
+    }
+    print_histogram(toAdmin, "seatwait", &totals[0]);
+    print_histogram(toAdmin, "movewait", &totals[1]);
+    print_histogram(toAdmin, "movetime", &totals[2]);
+    print_histogram(toAdmin, "gamemessages", &totals[3]);
+    print_histogram(toAdmin, "gamebytes", &totals[4]);
+    free(totals);
+}
+
+/* Prints the metrics of the game workers: the number of turns played, the
+ * number of writes to players (and bytes written), the average number of 
+ * writes per turn, the number of invalid moves, the number of players 
+ * dropped for not finishing their handshake in time, the number of players
+ * whose last output could not be sent before DRAIN_TIMEOUT, the number of
+ * games being played on each port (as activegames.port) and the 
+ * histograms. Only reads counters the workers, listeners and drainer 
+ * write, so never holds them up.
+ */
+void print_metrics(struct Server *s, FILE *toAdmin) {
+    unsigned long turns = 0, writes = 0, bytesSent = 0, invalidMoves = 0;
+    unsigned long timedOut = 0, spectators = 0, droppedSpectators = 0;
+    struct Port *currentPort;
+    struct Worker *w;
+    int i;
+
+    for (i = 0; i < s->workerCount; ++i) {
+        w = &s->workers[i];
+        turns += __atomic_load_n(&w->turns, __ATOMIC_RELAXED);
+        writes += __atomic_load_n(&w->writes, __ATOMIC_RELAXED);
+        bytesSent += __atomic_load_n(&w->bytesSent, __ATOMIC_RELAXED);
+        invalidMoves += __atomic_load_n(&w->invalidMoves, __ATOMIC_RELAXED);
+        spectators += __atomic_load_n(&w->spectators, __ATOMIC_RELAXED);
+        droppedSpectators += __atomic_load_n(&w->droppedSpectators, 
+                __ATOMIC_RELAXED);
+    }
+    fprintf(toAdmin, "turns,%lu\nwrites,%lu\nbytes,%lu\n", turns, writes, 
+            bytesSent);
+    fprintf(toAdmin, "writesperturn,%.2f\n", 
+            turns ? (double)writes / turns : 0.0);
+    fprintf(toAdmin, "invalidmoves,%lu\n", invalidMoves);
+    fprintf(toAdmin, "spectators,%lu\ndroppedspectators,%lu\n", spectators,
+            droppedSpectators);
+    for (currentPort = s->headPort; currentPort != NULL; 
+            currentPort = __atomic_load_n(&currentPort->nextPort, 
+            __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < currentPort->shards; ++i) {
+            timedOut += __atomic_load_n(&currentPort->listeners[i].timedOut,
+                    __ATOMIC_RELAXED);
         }
-        if (firstName == 0) {
-            return 0;
-        } else {
-            currentPlayer = currentPlayer->nextPlayer;
+    }
+    fprintf(toAdmin, "handshaketimeouts,%lu\n", timedOut);
+    fprintf(toAdmin, "drainsexpired,%lu\n", 
+            __atomic_load_n(&s->drainsExpired, __ATOMIC_RELAXED));
+    for (currentPort = s->headPort; currentPort != NULL; 
+            currentPort = __atomic_load_n(&currentPort->nextPort, 
+            __ATOMIC_ACQUIRE)) {
+        if (currentPort->port != 0) {
+            fprintf(toAdmin, "activegames.%d,%d\n", currentPort->port,
+                    __atomic_load_n(&currentPort->activeGames, 
+                    __ATOMIC_RELAXED));
         }
     }
-    return 1;
+    print_histograms(s, toAdmin);
+    fprintf(toAdmin, "OK\n");
+}
+
+/* Prints what has been allocated from the server's pools and arenas: the
+ * games, messages and spectators, the players' statistics and the 
+ * interned names (with how many player and game names there are). bytes
+ * is the memory each has taken from malloc.
+ */
+void print_allocations(struct Server *s, FILE *toAdmin) {
+    struct AllocCounts counts;
+
+    pool_counts(&s->gamePool, &counts);
+    fprintf(toAdmin, "games.allocs,%lu\ngames.frees,%lu\ngames.bytes,%lu\n",
+            counts.allocs, counts.frees, counts.bytes);
+    pool_counts(&s->messagePool, &counts);
+    fprintf(toAdmin, "messages.allocs,%lu\nmessages.frees,%lu\n"
+            "messages.bytes,%lu\n", counts.allocs, counts.frees, 
+            counts.bytes);
+    pool_counts(&s->spectatorPool, &counts);
+    fprintf(toAdmin, "spectators.allocs,%lu\nspectators.frees,%lu\n"
+            "spectators.bytes,%lu\n", counts.allocs, counts.frees, 
+            counts.bytes);
+    arena_counts(&s->stats.arena, &counts);
+    fprintf(toAdmin, "players.allocs,%lu\nplayers.bytes,%lu\n", 
+            counts.allocs, counts.bytes);
+    fprintf(toAdmin, "playernames.count,%d\nplayernames.bytes,%lu\n", 
+            name_count(&s->playerNames), name_bytes(&s->playerNames));
+    fprintf(toAdmin, "gamenames.count,%d\ngamenames.bytes,%lu\n", 
+            name_count(&s->gameNames), name_bytes(&s->gameNames));
+    fprintf(toAdmin, "OK\n");
 }
 
-/* Prints the game statistics for each player 
+/* Prints how many of each admin command have been handled and how long 
+ * they took on average and at most, in microseconds
  */
-void print_statistics(struct Players *headPlayer, FILE *toAdmin) {
-    struct Players *currentPlayer;
-    int playerNo = 0, i = 0;
+void print_command_latency(struct Server *s, FILE *toAdmin) {
+    struct CommandStats *stats;
+    int i;
+
+    for (i = 0; i < 26; ++i) {
+        stats = &s->commandStats[i];
+        if (stats->count) {
+            fprintf(toAdmin, "%c,%ld,%ld,%ld\n", 'A' + i, stats->count, 
+                    stats->totalMicros / stats->count, stats->maxMicros);
+        }
+    }
+    fprintf(toAdmin, "OK\n");
+}
 
-    currentPlayer = headPlayer;
+/* Records how long an admin command took from the time supplied until now
+ */
+void record_command_latency(struct Server *s, char command, 
+        struct timespec *started) {
+    struct CommandStats *stats;
+    struct timespec now;
+    long micros;
 
-    while (currentPlayer != NULL) {
-        playerNo++;
-        currentPlayer = currentPlayer->nextPlayer;
+    if (command < 'A' || command > 'Z') {
+        return;
     }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    micros = (now.tv_sec - started->tv_sec) * 1000000 + 
+            (now.tv_nsec - started->tv_nsec) / 1000;
 
-    char *printedPlayers[playerNo]; 
+    stats = &s->commandStats[command - 'A'];
+    stats->count++;
+    stats->totalMicros += micros;
+    if (micros > stats->maxMicros) {
+        stats->maxMicros = micros;
+    }
+}
 
-    for (int k = 0; k < playerNo; k++) {
-        printedPlayers[k] = NULL;
+/* Adds data to the output queued for an admin session
+ */
+void queue_output(struct AdminSession *a, char *data, size_t length) {
+    if (a->outSent == a->outLength) {
+        a->outSent = a->outLength = 0;
+    }
+    if (a->outLength + length > a->outCapacity) {
+        memmove(a->out, a->out + a->outSent, a->outLength - a->outSent);
+        a->outLength -= a->outSent;
+        a->outSent = 0;
+        while (a->outLength + length > a->outCapacity) {
+            a->outCapacity = a->outCapacity ? a->outCapacity * 2 : 
+                    ADMIN_BUFFER;
+        }
+        a->out = realloc(a->out, a->outCapacity);
     }
+    memcpy(a->out + a->outLength, data, length);
+    a->outLength += length;
+}
 
-    currentPlayer = headPlayer;
+/* Sends as much of the output queued for an admin session as the socket 
+ * will take without blocking
+ * @return 1 if all of it was sent, 0 if some is left, -1 on error
+ */
+int send_output(struct AdminSession *a) {
+    ssize_t sent;
 
-    while (currentPlayer != NULL) {
-        if(check_if_first_name(headPlayer, currentPlayer, printedPlayers, 
-                playerNo)) {
-            fprintf(toAdmin, "%s,%d,%d,%d\n", currentPlayer->name, 
-                    currentPlayer->gamesPlayed, currentPlayer->roundsWon, 
-                    currentPlayer->gamesWon);
-            printedPlayers[i] = currentPlayer->name;
-            i++;
-            if (i != playerNo) {
-                currentPlayer = headPlayer;
-            } else {
-                currentPlayer = currentPlayer->nextPlayer;
+    while (a->outSent < a->outLength) {
+        sent = write(a->fd, a->out + a->outSent, a->outLength - a->outSent);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-        } else {
-            currentPlayer = currentPlayer->nextPlayer;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
         }
+        a->outSent += sent;
     }
-    fprintf(toAdmin, "OK\n");
+    return 1;
 }
 
-
-/* Generate the game statistics and the print them to admin
+/* Writes the next batch of an export straight to the admin with writev. 
+ * Whatever the socket does not take is queued as normal output. Once every
+ * player has been written the export is ended (with a zero name length in 
+ * binary mode) with an OK line.
+ * @return 1 if the batch was all written, 0 if some was queued, -1 on error
  */
-void get_statistics(struct Server *s, FILE *toAdmin) {
-    struct Players *headPlayer;
-    struct Port *currentPort;
-    struct Game *currentGame;
-
-    ///SEMAPHORE
+int export_next(struct Server *s, struct AdminSession *a) {
+    struct iovec iov[EXPORT_BATCH * 2];
+    char counts[EXPORT_BATCH][40];
+    ssize_t written;
+    int count, i;
+
+    count = gather_export(a, iov, counts);
+    if (count == 0) {
+        if (a->exporting == 'B') {
+            queue_output(a, "\0\0", 2);
+        }
+        queue_output(a, "OK\n", 3);
+        record_command_latency(s, a->exporting, &a->exportStarted);
+        a->exporting = 0;
+        free(a->exportRows);
+        a->exportRows = NULL;
+        return 1;
+    }
 
-    headPlayer = create_player();
-    s->headPlayer = headPlayer;
+    do {
+        written = writev(a->fd, iov, count);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+    }
 
-    currentPort = s->headPort;
+    for (i = 0; i < count; ++i) {
+        if (written >= (ssize_t)iov[i].iov_len) {
+            written -= iov[i].iov_len;
+        } else {
+            written = (written < 0) ? 0 : written;
+            queue_output(a, (char*)iov[i].iov_base + written, 
+                    iov[i].iov_len - written);
+            written = 0;
+        }
+    }
+    return a->outSent == a->outLength;
+}
 
-    if (currentPort == NULL || currentPort->headGame->playerAName == NULL) {
+/* Handles one admin command, queuing its reply (everything written to the 
+ * stream handed to the command) on the session.
+ * Commands:
+ *  P<port> <deckfile>  open a new port in the background (replying with
+ *                      the id of the job opening it)
+ *  J[id]               print the state of a port opening job (or all)
+ *  S                   print all player statistics
+ *  L                   print the number of games waiting on each port
+ *  Q<limit> [prefix|*] [after]   print a page of player statistics (after
+ *                      being the rest of the line, as names may have spaces)
+ *  E / B               export all player statistics as CSV / binary
+ *  T                   print how long each command has taken
+ *  M                   print the game workers' output metrics
+ *  A                   print what has been allocated from the memory pools
+ */
+void handle_admin_command(struct Server *s, struct AdminSession *a, 
+        char *adminMessage) {
+    int maxLength, argNo, number, capacity = 0, restAt = -1;
+    char adminCommand, *reply, *rest;
+    size_t replyLength;
+    FILE *toAdmin;
+    struct timespec started;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    maxLength = strlen(adminMessage) + 1;
+    char deck[maxLength];
+    argNo = sscanf(adminMessage, "%c%d %s%n", &adminCommand, &number, 
+            deck, &restAt);   
+    if (argNo < 1) {
         return;
     }
+    // Whatever follows the third argument (after the space separating it)
+    rest = (restAt < 0) ? "" : adminMessage + restAt;
+    if (*rest == ' ') {
+        rest++;
+    }
 
-    while (currentPort != NULL) {
-        currentGame = currentPort->headGame;
-        while (currentGame != NULL) {
-            if (currentGame->playerAName != NULL) {
-                add_player_stats(currentGame, s);
-            }
-            currentGame = currentGame->nextGame;
-        }
-        currentPort = currentPort->nextPort;
+    if ((adminCommand == 'E' || adminCommand == 'B') && argNo == 1) {
+        a->exporting = adminCommand;
+        a->exportRows = NULL;
+        a->exportNext = 0;
+        a->exportCount = snapshot_players(&s->stats, "", 1, "", -1, 
+                &a->exportRows, &capacity);
+        a->exportStarted = started;
+        return;
     }
-    
-    print_statistics(headPlayer, toAdmin);
+
+    toAdmin = open_memstream(&reply, &replyLength);
+    if (adminCommand == 'P' && argNo == 3 && *rest == '\0') {
+        open_new_port(s, number, deck, toAdmin);
+    } else if (adminCommand == 'J' && (argNo == 2 ? number > 0 : 
+            argNo == 1 && adminMessage[1] == '\0')) {
+        print_jobs(s, (argNo == 2) ? number : 0, toAdmin);
+    } else if (adminCommand == 'S' && argNo == 1) {
+        print_statistics(&s->stats, toAdmin);
+    } else if (adminCommand == 'L' && argNo == 1) {
+        print_lobbies(s, toAdmin);
+    } else if (adminCommand == 'Q' && argNo >= 2 && number > 0) {
+        print_statistics_page(&s->stats, toAdmin, number, 
+                (argNo > 2 && strcmp(deck, "*")) ? deck : NULL,
+                (*rest != '\0') ? rest : NULL);
+    } else if (adminCommand == 'T' && argNo == 1) {
+        print_command_latency(s, toAdmin);
+    } else if (adminCommand == 'M' && argNo == 1) {
+        print_metrics(s, toAdmin);
+    } else if (adminCommand == 'A' && argNo == 1) {
+        print_allocations(s, toAdmin);
+    }
+    fclose(toAdmin);
+    queue_output(a, reply, replyLength);
+    free(reply);
+
+    record_command_latency(s, adminCommand, &started);
 }
 
-/* Wait on the admin port for a connection and a message
- * Ignore all messages but P and S. Perform P and S commands
+/* Closes an admin session and frees it
  */
-void admin_wait(struct Server *s) {
-    int fd = 0, fdAdmin = s->fdAdminPort, maxLength, argNo, newPort;
-    struct sockaddr_in fromAddr;
-    socklen_t fromAddrSize;
-    char hostname[MAXHOSTNAMELEN], *adminMessage, adminCommand;
-    FILE *fromAdmin, *toAdmin;
+void close_session(struct Server *s, struct AdminSession *a) {
+    epoll_ctl(s->adminEpollFd, EPOLL_CTL_DEL, a->fd, NULL);
+    close(a->fd);
+    free(a->out);
+    free(a->exportRows);
+    free(a);
+}
 
-    while (1) {
-        fromAddrSize = sizeof(struct sockaddr_in);
+/* Does as much work for an admin session as possible without blocking: 
+ * sends queued output, carries on exports and handles pipelined commands 
+ * in order. Then waits for whatever the session needs next.
+ */
+void service_session(struct Server *s, struct AdminSession *a) {
+    struct epoll_event event;
+    char *line;
+    int status;
+
+    while ((status = send_output(a)) > 0) {
+        if (a->exporting) {
+            if (export_next(s, a) < 0) {
+                status = -1;
+                break;
+            }
+            continue;
+        }
+        if (a->closing) {
+            break;
+        }
+        switch (read_line(&a->reader, &line)) {
+            case LINE_READY:
+                if (line[0] != 0) {
+                    handle_admin_command(s, a, line);
+                }
+                continue;
+            case LINE_TOO_LONG:
+                continue;
+            case LINE_EOF:
+                a->closing = 1;
+                continue;
+        }
+        break;
+    }
+
+    if (status < 0 || (a->closing && !a->exporting && 
+            a->outSent == a->outLength)) {
+        close_session(s, a);
+        return;
+    }
 
-        //if (!fd) {
-        fd = accept(fdAdmin, (struct sockaddr*)&fromAddr, &fromAddrSize);
-        //}
+    event.events = 0;
+    if (!a->closing && !a->exporting && a->outSent == a->outLength) {
+        event.events |= EPOLLIN;
+    }
+    if (a->exporting || a->outSent < a->outLength) {
+        event.events |= EPOLLOUT;
+    }
+    if (event.events != (unsigned int)a->events) {
+        event.data.ptr = a;
+        epoll_ctl(s->adminEpollFd, EPOLL_CTL_MOD, a->fd, &event);
+        a->events = event.events;
+    }
+}
 
-        getnameinfo((struct sockaddr*)&fromAddr, fromAddrSize,
-                hostname, MAXHOSTNAMELEN, NULL, 0, 0);
-        fromAdmin = fdopen(fd, "r");
-        toAdmin = fdopen(fd, "w"); //WHILE FROM HERE TO END
+/* Accepts every pending admin connection as a new session
+ */
+void accept_admins(struct Server *s) {
+    struct AdminSession *a;
+    struct epoll_event event;
+    int fd;
 
-        adminMessage = get_message(fromAdmin);
-        if (adminMessage == NULL) {
+    while ((fd = accept4(s->fdAdminPort, NULL, NULL, 
+            SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        a = calloc(1, sizeof(*a));
+        a->fd = fd;
+        init_line_reader(&a->reader, fd, LINE_BUFFER - 1);
+        a->events = EPOLLIN;
+        event.events = EPOLLIN;
+        event.data.ptr = a;
+        if (epoll_ctl(s->adminEpollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
             close(fd);
-            fd = 0;
-            break;
+            free(a);
         }
-		
-        maxLength = strlen(adminMessage);
-        char deck[maxLength];
-        argNo = sscanf(adminMessage, "%c%d %s", &adminCommand, &newPort, 
-                deck);   
+    }
+}
+
+/* Serve the admin port with an event loop, so any number of admins can hold
+ * sessions open and pipeline commands without waiting on each other.
+ */
+void admin_wait(struct Server *s) {
+    struct epoll_event events[MAX_EVENTS], event;
+    int eventCount, i;
+
+    s->adminEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (s->adminEpollFd < 0 || epoll_ctl(s->adminEpollFd, EPOLL_CTL_ADD, 
+            s->fdAdminPort, &event) < 0) {
+        exit_server(s, BAD_SYSTEM);
+    }
 
-        if (adminCommand == 'P' && argNo == 3) {
-            open_new_port(s, newPort, deck, toAdmin);
-        } else if (adminCommand == 'S' && argNo == 1) {
-            get_statistics(s, toAdmin);
+    while (1) {
+        eventCount = epoll_wait(s->adminEpollFd, events, MAX_EVENTS, -1);
+        for (i = 0; i < eventCount; ++i) {
+            if (events[i].data.ptr == NULL) {
+                accept_admins(s);
+            } else {
+                service_session(s, 
+                        (struct AdminSession*)events[i].data.ptr);
+            }
         }
- 		
-        fflush(toAdmin);
     }
 }
 
 /* Create the head Port strucutre and put it in the Server structure
  * @Return the address of the head strucutre
  */
-struct Port* create_head(struct Server *s) {
+struct Port* create_head(struct Server *s, int port, char *deckfile) {
     struct Port *head;
 	
-    head = malloc(sizeof(*head));
-    head->nextPort = NULL;
+    head = create_port(s, port, deckfile);
     s->headPort = head;	
 	
     return head;
@@ -1903,36 +3923,63 @@ struct Port* create_head(struct Server *s) {
  */
 void parse_args(struct Server *s, char *argv[], int argc) {
     char *next;
-    int i, deckError;
-    pthread_t threadId;
+    int i, deckError, option;
+    long timeout;
     struct Port *head, *previous, *new, *currentPort;
 
+    // -s shards: the number of listeners (and lobbies) per game port
+    // -t timeout: milliseconds a player has to send their names (at most a
+    // day)
+    // -u: play games with io_uring rather than epoll
+    s->shards = 1;
+    s->useRing = 0;
+    timeout = HANDSHAKE_TIMEOUT;
+    opterr = 0;
+    while ((option = getopt(argc, argv, "+s:t:u")) != -1) {
+        if (option == 's') {
+            s->shards = strtol(optarg, &next, 10);
+            if (*next != '\0' || s->shards < 1 || 
+                    s->shards > MAX_SHARDS) {
+                exit_server(s, BAD_ARGS);
+            }
+        } else if (option == 't') {
+            timeout = strtol(optarg, &next, 10);
+            if (*next != '\0' || timeout < 1 || 
+                    timeout > MAX_HANDSHAKE_TIMEOUT) {
+                exit_server(s, BAD_ARGS);
+            }
+        } else if (option == 'u') {
+            s->useRing = 1;
+        } else {
+            exit_server(s, BAD_ARGS);
+        }
+    }
+    s->handshakeTimeout = (uint64_t)timeout * 1000000;
+    // The rest of the arguments are read as if there were no options
+    argv += optind - 1;
+    argc -= optind - 1;
+
     if (argc % 2 != 0 || argc == 1) {
         exit_server(s, BAD_ARGS);
     }
 	
-    head = create_head(s);
     check_valid_port(s, argv[1]);
     s->adminPort = strtol(argv[1], &next, 10);
     for (i = 2; i < argc; i += 2) {
         check_valid_port(s, argv[i]);
     }
 
-    if (argc > 2) {
-        head->port = strtol(argv[2], &next, 10);
+    if (argc == 2) {
+        head = create_head(s, 0, "");
+    } else {
+        head = create_head(s, strtol(argv[2], &next, 10), argv[3]);
         if (head->port == s->adminPort) {
             exit_server(s, BAD_PORT);
         }
-        head->deckfile = malloc(sizeof(strlen(argv[3]) + 1));
-        strncpy(head->deckfile, argv[3], (strlen(argv[3]) + 1));
         previous = head;
         for (i = 4; i < argc; i += 2) {
-            new = malloc(sizeof(*new));
+            new = create_port(s, strtol(argv[i], &next, 10), argv[i + 1]);
             previous->nextPort = new;
-            new->nextPort = NULL;   
-            new->port = strtol(argv[i], &next, 10);
-            new->deckfile = malloc(sizeof(strlen(argv[i + 1]) + 1));
-            strncpy(new->deckfile, argv[i + 1], (strlen(argv[i + 1]) + 1));
             previous = new;
             check_for_duplicate_port(s, new->port, head);
         }
@@ -1940,14 +3987,19 @@ void parse_args(struct Server *s, char *argv[], int argc) {
 
     currentPort = head;
     s->fdAdminPort = open_listen(s, s->adminPort);
+    start_drainer(s);
+    start_workers(s);
+    start_port_loaders(s);
 
     while (currentPort != NULL && argc > 2) {
-        currentPort->fd = open_listen(s, currentPort->port);
-        if ((deckError = load_deckfile(s, currentPort))) {
+        if (open_listeners(currentPort)) {
+            exit_server(s, LISTEN_FAIL);
+        }
+        if ((deckError = load_deckfile(currentPort->deckfile,
+                &currentPort->decks))) {
             exit_server(s, deckError);
         }
-        pthread_create(&threadId, NULL, connection_wait, (void*)currentPort);
-        pthread_detach(threadId);
+        start_listeners(currentPort);
         currentPort = currentPort->nextPort;
     }
     admin_wait(s);
@@ -1957,6 +4009,24 @@ int main(int argc, char *argv[]) {
     struct Server *s = NULL;
 
     s = malloc(sizeof(*s));
+    init_stats(&s->stats);
+    memset(s->commandStats, 0, sizeof(s->commandStats));
+    init_pool(&s->gamePool, sizeof(struct Game));
+    init_pool(&s->handshakePool, sizeof(struct Handshake));
+    init_pool(&s->messagePool, sizeof(struct Message));
+    init_pool(&s->spectatorPool, sizeof(struct Spectator));
+    init_names(&s->playerNames, 0);
+    init_names(&s->gameNames, 1);
+    pthread_mutex_init(&s->portLock, NULL);
+    pthread_mutex_init(&s->jobLock, NULL);
+    pthread_cond_init(&s->jobQueued, NULL);
+    s->jobs = NULL;
+    s->queueHead = NULL;
+    s->queueTail = NULL;
+    s->nextJobId = 0;
+
+    // Players leaving mid game must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     parse_args(s, argv, argc);
 
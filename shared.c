@@ -1,3 +1,9 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared.h"
+
 /* Check if the supplied character is a valid card in the love letter game. 
  * Valid cards are '1', '2', '3', '4', '5', '6', '7' or '8'.
  * @params card The card to check_card
@@ -79,3 +85,172 @@ int check_valid_move(char source, char discard, char target, char guess,
     }
     return 0;
 }
+
+/* Set up a line reader on a file descriptor
+ * @params r The line reader
+ * @params fd The file descriptor to read from (blocking or non-blocking)
+ * @params maxLength The longest line to accept (less than LINE_BUFFER)
+ */
+void init_line_reader(struct LineReader *r, int fd, int maxLength) {
+    r->fd = fd;
+    r->maxLength = (maxLength < LINE_BUFFER) ? maxLength : LINE_BUFFER - 1;
+    r->start = 0;
+    r->end = 0;
+    r->discarding = 0;
+}
+
+/* Gets the next line from a line reader, reading from its file descriptor 
+ * only when no whole line is buffered. The line is left in the reader's 
+ * buffer with the newline replaced by a null terminator, and is only valid
+ * until the next call. At end of file a last line with no newline is still
+ * returned.
+ * @params r The line reader
+ * @params line Set to point to the line
+ * @return LINE_READY if a line was read, LINE_WAIT if a non-blocking file 
+ * descriptor has no more to read yet, LINE_EOF at end of file (or on error)
+ * or LINE_TOO_LONG if a line longer than the maximum was thrown away
+ */
+int read_line(struct LineReader *r, char **line) {
+    char *newline;
+    ssize_t bytes;
+    int length;
+
+    while (1) {
+        newline = memchr(r->buffer + r->start, '\n', r->end - r->start);
+        if (newline != NULL) {
+            length = newline - (r->buffer + r->start);
+            *newline = 0;
+            *line = r->buffer + r->start;
+            r->start += length + 1;
+            if (r->discarding) {
+                // The end of a line that was too long
+                r->discarding = 0;
+                continue;
+            }
+            return (length > r->maxLength) ? LINE_TOO_LONG : LINE_READY;
+        }
+
+        if (r->end - r->start > r->maxLength) {
+            r->start = r->end = 0;
+            if (!r->discarding) {
+                r->discarding = 1;
+                return LINE_TOO_LONG;
+            }
+        } else if (r->start == r->end) {
+            r->start = r->end = 0;
+        } else if (r->end == LINE_BUFFER) {
+            memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+
+        bytes = read(r->fd, r->buffer + r->end, LINE_BUFFER - r->end);
+        if (bytes > 0) {
+            r->end += bytes;
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return LINE_WAIT;
+        }
+        if (r->end > r->start && !r->discarding) {
+            r->buffer[r->end] = 0;
+            *line = r->buffer + r->start;
+            r->start = r->end;
+            return LINE_READY;
+        }
+        return LINE_EOF;
+    }
+}
+
+/* Gets exactly length bytes (a binary frame) from a line reader, reading 
+ * from its file descriptor only when not enough are buffered, so frames 
+ * can follow lines read with the same reader.
+ * @params r The line reader
+ * @params frame Set to the bytes read
+ * @params length The number of bytes to get (at most LINE_BUFFER)
+ * @return LINE_READY if the frame was read, LINE_WAIT if a non-blocking 
+ * file descriptor has no more to read yet or LINE_EOF at end of file (or 
+ * on error) before the whole frame
+ */
+int read_frame(struct LineReader *r, char *frame, int length) {
+    ssize_t bytes;
+
+    while (r->end - r->start < length) {
+        if (r->start == r->end) {
+            r->start = r->end = 0;
+        } else if (r->start + length > LINE_BUFFER) {
+            memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+
+        bytes = read(r->fd, r->buffer + r->end, LINE_BUFFER - r->end);
+        if (bytes > 0) {
+            r->end += bytes;
+        } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return LINE_WAIT;
+        } else if (bytes == 0 || errno != EINTR) {
+            return LINE_EOF;
+        }
+    }
+    memcpy(frame, r->buffer + r->start, length);
+    r->start += length;
+    return LINE_READY;
+}
+
+/* Gets the nibble a field of a binary frame is sent as
+ * @return the field's index in "0123456789-ABCD", or FIELD_NONE if it is 
+ * not one of them
+ */
+static int field_nibble(char field) {
+    if (field >= '0' && field <= '9') {
+        return field - '0';
+    }
+    if (field == '-') {
+        return 10;
+    }
+    if (field >= 'A' && field <= 'D') {
+        return 11 + field - 'A';
+    }
+    return FIELD_NONE;
+}
+
+/* Packs the fields of a message (a character each) into the nibbles of 
+ * length bytes, filling those left over with FIELD_NONE
+ * @params packed Set to the packed fields
+ * @params length The number of bytes to pack into
+ * @params fields The fields, null terminated
+ */
+void pack_fields(char *packed, int length, char *fields) {
+    int i, high, low;
+
+    for (i = 0; i < length; ++i) {
+        high = *fields ? field_nibble(*fields++) : FIELD_NONE;
+        low = *fields ? field_nibble(*fields++) : FIELD_NONE;
+        packed[i] = (high << 4) | low;
+    }
+}
+
+/* Unpacks the fields packed into the nibbles of length bytes, up to the 
+ * first FIELD_NONE
+ * @params fields Set to the fields, null terminated (so it must have room 
+ * for 2 * length + 1 characters)
+ * @params packed The packed fields
+ * @params length The number of bytes packed into
+ */
+void unpack_fields(char *fields, char *packed, int length) {
+    static const char fieldChars[] = "0123456789-ABCD";
+    int i, nibble;
+
+    for (i = 0; i < 2 * length; ++i) {
+        nibble = (packed[i / 2] >> ((i % 2) ? 0 : 4)) & 0xf;
+        if (nibble == FIELD_NONE) {
+            break;
+        }
+        fields[i] = fieldChars[nibble];
+    }
+    fields[i] = 0;
+}
@@ -4,11 +4,71 @@
 #ifndef SHARED_H_
 #define SHARED_H_
 
+// Size of a line reader's buffer; lines can be at most one less than this
+#define LINE_BUFFER 4096
+
+// Results of read_line
+#define LINE_READY 0
+#define LINE_WAIT 1
+#define LINE_EOF 2
+#define LINE_TOO_LONG 3
+
+/* The binary protocol, for clients that send BINARY_HELLO as a line before
+ * their name. Names and game information are still sent as lines, but 
+ * every game message from the server is then a FRAME_LENGTH byte frame: 
+ * an opcode (the message's command) and up to FRAME_FIELDS fields, a 
+ * nibble each (high nibble first), in the order the text message has them.
+ * Each field is one of the characters in "0123456789-ABCD" (by its index);
+ * FIELD_NONE fills the rest. Moves are MOVE_FRAME_LENGTH byte frames of the
+ * card, target and guess fields, with no opcode.
+ */
+#define BINARY_HELLO "\001"
+
+/* A client that sends SPECTATE_HELLO as a line, and then the name of a game
+ * being played on the port, watches that game instead of playing. It is 
+ * sent "<players> -" and the players' names as lines, then the game's 
+ * thishappened, scores and gameover messages (always as text), starting 
+ * from the oldest the server still has.
+ */
+#define SPECTATE_HELLO "\002"
+#define FRAME_LENGTH 5
+#define FRAME_FIELDS 8
+#define MOVE_FRAME_LENGTH 2
+#define FIELD_NONE 15
+
+// Binary protocol opcodes
+#define OP_GAMEOVER 1
+#define OP_NEWROUND 2
+#define OP_YOURTURN 3
+#define OP_HAPPENED 4
+#define OP_REPLACE 5
+#define OP_SCORES 6
+#define OP_YES 7
+#define OP_NO 8
+
+/* Reads newline terminated lines from a file descriptor through a fixed 
+ * buffer, so reading a line never allocates. Lines longer than maxLength 
+ * are thrown away.
+ */
+struct LineReader {
+    int fd;
+    int maxLength;
+    int start;
+    int end;
+    int discarding;
+    char buffer[LINE_BUFFER + 1];
+};
+
 // Function Prototypes
 int check_card(char card);
 int check_player(char player, int players);
 int check_valid_move(char source, char discard, char target, char guess,
         int players);
+void init_line_reader(struct LineReader *r, int fd, int maxLength);
+int read_line(struct LineReader *r, char **line);
+int read_frame(struct LineReader *r, char *frame, int length);
+void pack_fields(char *packed, int length, char *fields);
+void unpack_fields(char *fields, char *packed, int length);
 
 #endif
 
@@ -0,0 +1,319 @@
+/* uring.c - A minimal io_uring ring for the server's reactor workers
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+// The buffer group the provided buffers are registered as
+#define BUFFER_GROUP 0
+
+/* The ring shared with the kernel: the submission queue (with its array of
+ * indexes, kept as 0, 1, 2... so entry i is always sqes[i]) and completion
+ * queue in one mapping, and the submission queue entries in another.
+ * tail is the submission queue tail not yet given to the kernel. The
+ * provided buffers are bufferSize bytes each, in bufferData, handed to the
+ * kernel through bufferRing.
+ */
+struct Ring {
+    int fd;
+    void *map;
+    size_t mapLength;
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int tail;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufferRing;
+    unsigned int bufferMask;
+    unsigned int bufferSize;
+    unsigned short bufferTail;
+    char *bufferData;
+};
+
+/* Gives a buffer to the kernel to receive into
+ */
+static void add_buffer(struct Ring *r, int id) {
+    struct io_uring_buf *buffer;
+
+    buffer = &r->bufferRing->bufs[r->bufferTail & r->bufferMask];
+    buffer->addr = (uint64_t)(uintptr_t)(r->bufferData +
+            (size_t)id * r->bufferSize);
+    buffer->len = r->bufferSize;
+    buffer->bid = id;
+    r->bufferTail++;
+}
+
+/* Registers buffers (count a power of two) for multishot recvs to receive
+ * into
+ * @return 0 on success, -1 (with nothing left allocated) if they could not
+ *      be registered
+ */
+static int init_buffers(struct Ring *r, unsigned int count,
+        unsigned int size) {
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+    int error;
+
+    r->bufferRing = mmap(NULL, count * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->bufferRing == MAP_FAILED) {
+        return -1;
+    }
+    r->bufferData = malloc((size_t)count * size);
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->bufferRing;
+    reg.ring_entries = count;
+    reg.bgid = BUFFER_GROUP;
+    if (r->bufferData == NULL || syscall(__NR_io_uring_register, r->fd, 
+            IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        error = errno;
+        free(r->bufferData);
+        munmap(r->bufferRing, count * sizeof(struct io_uring_buf));
+        errno = error;
+        return -1;
+    }
+
+    r->bufferMask = count - 1;
+    r->bufferSize = size;
+    r->bufferTail = 0;
+    for (i = 0; i < count; ++i) {
+        add_buffer(r, i);
+    }
+    __atomic_store_n(&r->bufferRing->tail, r->bufferTail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Maps the queues of a ring set up by io_uring_setup
+ * @return 0 on success, -1 if they could not be mapped
+ */
+static int map_ring(struct Ring *r, struct io_uring_params *params) {
+    size_t sqLength, cqLength;
+    char *map;
+    unsigned int i;
+
+    sqLength = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    cqLength = params->cq_off.cqes +
+            params->cq_entries * sizeof(struct io_uring_cqe);
+    r->mapLength = (sqLength > cqLength) ? sqLength : cqLength;
+    r->map = mmap(NULL, r->mapLength, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->map == MAP_FAILED) {
+        return -1;
+    }
+    r->sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+            IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->map, r->mapLength);
+        return -1;
+    }
+
+    map = r->map;
+    r->sqHead = (unsigned int*)(map + params->sq_off.head);
+    r->sqTail = (unsigned int*)(map + params->sq_off.tail);
+    r->sqMask = *(unsigned int*)(map + params->sq_off.ring_mask);
+    r->sqEntries = params->sq_entries;
+    r->tail = *r->sqTail;
+    for (i = 0; i < params->sq_entries; ++i) {
+        ((unsigned int*)(map + params->sq_off.array))[i] = i;
+    }
+    r->cqHead = (unsigned int*)(map + params->cq_off.head);
+    r->cqTail = (unsigned int*)(map + params->cq_off.tail);
+    r->cqMask = *(unsigned int*)(map + params->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(map + params->cq_off.cqes);
+    return 0;
+}
+
+/* Makes a ring, with provided buffers for multishot recvs. Rings are never
+ * destroyed, so if it can't be made the server should not carry on.
+ * @params entries The size of the submission queue (a power of two)
+ * @params buffers The number of provided buffers (a power of two)
+ * @params bufferSize The size of each provided buffer
+ * @return the ring or NULL (with errno set) if io_uring is not available
+ */
+struct Ring *ring_create(unsigned int entries, unsigned int buffers,
+        unsigned int bufferSize) {
+    struct io_uring_params params;
+    struct Ring *r = calloc(1, sizeof(*r));
+    int error;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0 && errno == EINVAL) {
+        // An older kernel, without the flags
+        memset(&params, 0, sizeof(params));
+        r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+    if (map_ring(r, &params) < 0) {
+        error = errno;
+        close(r->fd);
+        free(r);
+        errno = error;
+        return NULL;
+    }
+    if (init_buffers(r, buffers, bufferSize) < 0) {
+        error = errno;
+        munmap(r->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        munmap(r->map, r->mapLength);
+        close(r->fd);
+        free(r);
+        errno = error;
+        return NULL;
+    }
+    return r;
+}
+
+/* Gives the kernel the entries added to the submission queue and waits for
+ * at least wait operations to finish
+ * @return 0 on success, -1 if the kernel would not take them
+ */
+static int enter(struct Ring *r, unsigned int wait) {
+    unsigned int submit;
+    int result;
+
+    __atomic_store_n(r->sqTail, r->tail, __ATOMIC_RELEASE);
+    submit = r->tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+    do {
+        result = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    return (result < 0) ? -1 : 0;
+}
+
+/* Gets a cleared submission queue entry, submitting the queue if it is
+ * full
+ */
+static struct io_uring_sqe *next_sqe(struct Ring *r, int opcode, int fd,
+        uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    while (r->tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >=
+            r->sqEntries) {
+        enter(r, 0);
+    }
+    sqe = &r->sqes[r->tail & r->sqMask];
+    r->tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    return sqe;
+}
+
+/* Starts receiving from a socket into the provided buffers until it
+ * closes, fails, runs out of buffers or is cancelled. Each receive is a
+ * completion with more set, except the last.
+ */
+void ring_recv(struct Ring *r, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_RECV, fd, data);
+
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+}
+
+/* Sends a message (gathered from the buffers in its iovecs) to a socket.
+ * Neither the message nor its buffers may change until the send finishes.
+ */
+void ring_sendmsg(struct Ring *r, int fd, struct msghdr *message, 
+        uint64_t data) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_SENDMSG, fd, data);
+
+    sqe->addr = (uint64_t)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/* Reads from a file (at its current position)
+ */
+void ring_read(struct Ring *r, int fd, void *buffer, size_t length,
+        uint64_t data) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_READ, fd, data);
+
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = (uint64_t)-1;
+}
+
+/* Cancels the operation started with the data target
+ */
+void ring_cancel(struct Ring *r, uint64_t target, uint64_t data) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_ASYNC_CANCEL, -1,
+            data);
+
+    sqe->addr = target;
+}
+
+/* Cancels every operation on a file descriptor
+ */
+void ring_cancel_fd(struct Ring *r, int fd, uint64_t data) {
+    struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_ASYNC_CANCEL, fd,
+            data);
+
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+/* Submits the operations started since the last call and waits until at
+ * least one operation has finished
+ * @return 0 on success, -1 on failure
+ */
+int ring_wait(struct Ring *r) {
+    return enter(r, 1);
+}
+
+/* Takes the next finished operation from the completion queue
+ * @return 1 if there was one, 0 if not
+ */
+int ring_next(struct Ring *r, struct Completion *done) {
+    unsigned int head = *r->cqHead;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    cqe = &r->cqes[head & r->cqMask];
+    done->data = cqe->user_data;
+    done->result = cqe->res;
+    done->buffer = (cqe->flags & IORING_CQE_F_BUFFER) ?
+            (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    done->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Gets a provided buffer (that data has been received into)
+ */
+char *ring_buffer(struct Ring *r, int id) {
+    return r->bufferData + (size_t)id * r->bufferSize;
+}
+
+/* Gives a provided buffer back to the kernel once its data has been used
+ */
+void ring_recycle(struct Ring *r, int id) {
+    add_buffer(r, id);
+    __atomic_store_n(&r->bufferRing->tail, r->bufferTail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,42 @@
+/* uring.h - A minimal io_uring ring for the server's reactor workers
+ * Made with the raw system calls (no liburing). Only the operations the
+ * workers need are provided: multishot recv into a ring of provided
+ * buffers, sendmsg, read and cancel. Each ring is used by one thread.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* A finished operation, from the ring's completion queue. buffer is the
+ * provided buffer the data was received into, or -1. more is set if the
+ * operation (a multishot recv) will finish again.
+ */
+struct Completion {
+    uint64_t data;
+    int result;
+    int buffer;
+    int more;
+};
+
+struct Ring;
+
+// Function Prototypes
+struct Ring *ring_create(unsigned int entries, unsigned int buffers,
+        unsigned int bufferSize);
+void ring_recv(struct Ring *r, int fd, uint64_t data);
+void ring_sendmsg(struct Ring *r, int fd, struct msghdr *message, 
+        uint64_t data);
+void ring_read(struct Ring *r, int fd, void *buffer, size_t length,
+        uint64_t data);
+void ring_cancel(struct Ring *r, uint64_t target, uint64_t data);
+void ring_cancel_fd(struct Ring *r, int fd, uint64_t data);
+int ring_wait(struct Ring *r);
+int ring_next(struct Ring *r, struct Completion *done);
+char *ring_buffer(struct Ring *r, int id);
+void ring_recycle(struct Ring *r, int id);
+
+#endif